@@ -0,0 +1,206 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include "opengalax.h"
+#include "capture.h"
+
+/*
+ * Capture of the panel traffic, see capture.h for the format. Records are
+ * encoded into the current block in memory, which only goes to the file
+ * when it is full, every CAPTURE_FLUSH us, on SIGUSR2 and on exit. The
+ * flight recorder writes its dumps through the same writer.
+ */
+
+#define CAPTURE_FLUSH 5000000	/* us */
+
+/* largest record: tag, time, length and a full read */
+#define CAPTURE_RECORD_MAX (1 + 10 + 10 + BATCH_MAX * 5)
+
+struct capture_file {
+	int fd;
+	long long start_ns;	/* CLOCK_MONOTONIC time of capture time 0 */
+
+	union {
+		struct capture_block hdr;
+		unsigned char buf[CAPTURE_BLOCK_SIZE];
+	} block;
+
+	struct capture_index index;
+
+	uint64_t block_no;	/* data block being filled */
+	long long last_us;	/* time of the last record */
+	int last_x, last_y;
+};
+
+/* the capture= file */
+static capture_file *live;
+static long long flush_us;
+
+/* start_ns is the CLOCK_MONOTONIC time the capture starts at */
+capture_file *capture_open (const char *path, long long start_ns) {
+
+	struct capture_header header;
+	struct timespec ts;
+	capture_file *c;
+
+	c = calloc (1, sizeof (*c));
+	if (c == NULL)
+		return NULL;
+
+	c->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (c->fd < 0) {
+		free (c);
+		return NULL;
+	}
+	c->start_ns = start_ns;
+	c->index.magic = CAPTURE_INDEX_MAGIC;
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, CAPTURE_MAGIC, sizeof (header.magic));
+	header.block_size = CAPTURE_BLOCK_SIZE;
+	header.index_every = CAPTURE_INDEX_EVERY;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	header.start_realtime_us = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	header.start_realtime_us -= (ts.tv_sec * 1000000000LL + ts.tv_nsec - start_ns) / 1000;
+
+	if (pwrite (c->fd, &header, sizeof (header), 0) != sizeof (header))
+		die ("error: capture");
+
+	return c;
+}
+
+/* write the block being filled, it is written again as it grows */
+void capture_sync (capture_file *c) {
+
+	if (c->block.hdr.records == 0)
+		return;
+
+	if (pwrite (c->fd, c->block.buf, sizeof (c->block.hdr) + c->block.hdr.used, capture_data_offset (c->block_no)) < 0 ||
+	    pwrite (c->fd, &c->index, sizeof (c->index), capture_index_offset (c->block_no / (CAPTURE_INDEX_EVERY - 1))) < 0)
+		die ("error: capture");
+}
+
+void capture_close (capture_file *c) {
+	capture_sync (c);
+	close (c->fd);
+	free (c);
+}
+
+static void capture_next_block (capture_file *c) {
+
+	capture_sync (c);
+
+	c->block_no++;
+	if (c->block_no % (CAPTURE_INDEX_EVERY - 1) == 0)
+		c->index.count = 0;
+
+	memset (&c->block.hdr, 0, sizeof (c->block.hdr));
+}
+
+/* start a record at time us, moving to a new block if it might not fit */
+static unsigned char *capture_record (capture_file *c, long long us, int tag) {
+
+	unsigned char *p;
+
+	if (sizeof (c->block.hdr) + c->block.hdr.used + CAPTURE_RECORD_MAX > CAPTURE_BLOCK_SIZE)
+		capture_next_block (c);
+
+	if (c->block.hdr.records == 0) {
+		c->block.hdr.magic = CAPTURE_DATA_MAGIC;
+		c->block.hdr.time_us = us;
+		c->index.time_us[c->index.count++] = us;
+		c->last_us = us;
+		c->last_x = 0;
+		c->last_y = 0;
+	}
+	c->block.hdr.records++;
+
+	p = c->block.buf + sizeof (c->block.hdr) + c->block.hdr.used;
+	*p++ = tag;
+	p = capture_put_varint (p, us - c->last_us);
+	c->last_us = us;
+	return p;
+}
+
+static void capture_end (capture_file *c, unsigned char *p) {
+	c->block.hdr.used = p - (c->block.buf + sizeof (c->block.hdr));
+}
+
+/* bytes read from the serial port at ns, CLOCK_MONOTONIC */
+void capture_write_raw (capture_file *c, long long ns, const unsigned char *data, int len) {
+
+	unsigned char *p;
+
+	if (len > BATCH_MAX * 5)
+		len = BATCH_MAX * 5;
+
+	p = capture_record (c, (ns - c->start_ns) / 1000, CAPTURE_RAW);
+	p = capture_put_varint (p, len);
+	memcpy (p, data, len);
+	capture_end (c, p + len);
+}
+
+/* a sample decoded at ns */
+void capture_write_sample (capture_file *c, long long ns, int x, int y, int click, int inside) {
+
+	unsigned char *p;
+	int tag = CAPTURE_SAMPLE;
+
+	if (click == PRESS)
+		tag |= CAPTURE_PRESSED;
+	if (inside)
+		tag |= CAPTURE_INSIDE;
+
+	p = capture_record (c, (ns - c->start_ns) / 1000, tag);
+	p = capture_put_zigzag (p, x - c->last_x);
+	p = capture_put_zigzag (p, y - c->last_y);
+	capture_end (c, p);
+
+	c->last_x = x;
+	c->last_y = y;
+}
+
+int capture_init (const char *path) {
+
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	live = capture_open (path, ts.tv_sec * 1000000000LL + ts.tv_nsec);
+	return live == NULL ? -1 : 0;
+}
+
+void capture_flush (void) {
+
+	if (live == NULL)
+		return;
+
+	capture_sync (live);
+	flush_us = live->last_us;
+}
+
+void capture_raw (const unsigned char *data, int len, struct timespec *now) {
+
+	capture_write_raw (live, now->tv_sec * 1000000000LL + now->tv_nsec, data, len);
+
+	if (live->last_us - flush_us >= CAPTURE_FLUSH)
+		capture_flush ();
+}
+
+/* samples decoded from the last bytes captured, stamped with their time */
+void capture_samples (const sample_batch *batch) {
+
+	long long ns = live->start_ns + live->last_us * 1000;
+	int i;
+
+	for (i = 0; i < batch->count; i++)
+		capture_write_sample (live, ns, batch->x[i], batch->y[i], batch->click[i], batch->inside[i]);
+}
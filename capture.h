@@ -0,0 +1,116 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * Capture file format, written by the daemon (capture.c) and read by
+ * opengalax-replay.
+ *
+ * A CAPTURE_HEADER_SIZE header is followed by CAPTURE_BLOCK_SIZE blocks.
+ * Every CAPTURE_INDEX_EVERY-th block is an index block with the start time
+ * of the data blocks before it, the others are data blocks, so any block
+ * is found from its number alone.
+ *
+ * A data block holds whole records. Each record is a tag byte, the time
+ * since the previous record of the block (the first one since the block
+ * time) in us as a varint, then:
+ *   CAPTURE_RAW:    length varint, the bytes read from the serial port
+ *   CAPTURE_SAMPLE: x and y as zigzag varints, relative to the previous
+ *                   sample of the block; pressed and inside in the tag
+ */
+
+#define CAPTURE_MAGIC		"OGCAPT01"
+#define CAPTURE_HEADER_SIZE	4096
+#define CAPTURE_BLOCK_SIZE	65536
+#define CAPTURE_INDEX_EVERY	64
+
+#define CAPTURE_DATA_MAGIC	0x4b4c4244U	/* "DBLK" */
+#define CAPTURE_INDEX_MAGIC	0x4b4c4249U	/* "IBLK" */
+
+#define CAPTURE_RAW		1
+#define CAPTURE_SAMPLE		2
+#define CAPTURE_TYPE		0x03
+#define CAPTURE_PRESSED		0x04
+#define CAPTURE_INSIDE		0x08
+
+struct capture_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t index_every;
+	int64_t start_realtime_us;	/* wall clock when the capture started */
+};
+
+struct capture_block {
+	uint32_t magic;
+	uint32_t used;			/* bytes of records after the header */
+	uint32_t records;
+	uint32_t pad;
+	int64_t time_us;		/* since the start of the capture */
+};
+
+struct capture_index {
+	uint32_t magic;
+	uint32_t count;			/* data blocks listed so far */
+	int64_t time_us[CAPTURE_INDEX_EVERY - 1];
+};
+
+/* position of data block n in the file */
+static inline uint64_t capture_data_offset (uint64_t n) {
+	return CAPTURE_HEADER_SIZE + (n + n / (CAPTURE_INDEX_EVERY - 1)) * (uint64_t) CAPTURE_BLOCK_SIZE;
+}
+
+/* position of the index block listing data blocks from group * (CAPTURE_INDEX_EVERY - 1) */
+static inline uint64_t capture_index_offset (uint64_t group) {
+	return CAPTURE_HEADER_SIZE + (group * CAPTURE_INDEX_EVERY + CAPTURE_INDEX_EVERY - 1) * (uint64_t) CAPTURE_BLOCK_SIZE;
+}
+
+static inline unsigned char *capture_put_varint (unsigned char *p, uint64_t v) {
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static inline unsigned char *capture_put_zigzag (unsigned char *p, int64_t v) {
+	return capture_put_varint (p, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+/* returns NULL when the varint runs past end */
+static inline const unsigned char *capture_get_varint (const unsigned char *p, const unsigned char *end, uint64_t *v) {
+
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+static inline const unsigned char *capture_get_zigzag (const unsigned char *p, const unsigned char *end, int64_t *v) {
+
+	uint64_t u;
+
+	p = capture_get_varint (p, end, &u);
+	*v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+	return p;
+}
+
+#endif
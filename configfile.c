@@ -9,6 +9,7 @@
  *
  */
 
+#include <stddef.h>
 #include "opengalax.h"
 
 #define CONFIG_FILE "/etc/opengalax.conf"
@@ -22,6 +23,44 @@ static const conf_data default_config = {
 	/* rightclick_range */ 10,
 	/* direction */ 0,
 	/* psmouse */ 0,
+	/* edge_left */ 0,
+	/* edge_right */ 0,
+	/* edge_top */ 0,
+	/* edge_bottom */ 0,
+	/* jump_max */ 0,
+	/* min_press_duration */ 0,
+	/* touchdown_threshold */ 10,
+	/* touchdown_timeout */ 0,
+	/* liftoff_factor */ 4,
+	/* liftoff_min */ 50,
+	/* threaded */ 0,
+	/* io_uring */ 0,
+	/* fuzz_x */ 0,
+	/* fuzz_y */ 0,
+	/* flat_x */ 0,
+	/* flat_y */ 0,
+	/* resolution_x */ 0,
+	/* resolution_y */ 0,
+	/* sample_rate */ 200,
+	/* sample_resolution */ -1,
+	/* idle_rate */ 0,
+	/* idle_timeout */ 5000,
+	/* panel_bits */ 0,
+	/* shm_ring */ 0,
+	/* inject */ 0,
+	/* trace */ 0,
+	/* capture */ "",
+	/* recorder */ 1,
+	/* live_direction */ 0,
+	/* screen_width */ 0,
+	/* screen_height */ 0,
+	/* map_x */ 0,
+	/* map_y */ 0,
+	/* map_width */ 0,
+	/* map_height */ 0,
+	/* debounce_press */ 0,
+	/* debounce_release */ 0,
+	/* debounce_range */ 20,
 };
 
 static const calibration_data default_calibration = {
@@ -29,9 +68,11 @@ static const calibration_data default_calibration = {
 	/* xmax */ 2047,
 	/* ymin */ 0,
 	/* ymax */ 2047,
+	/* mesh_size */ 0,
+	/* mesh */ { { { 0 } } },
 };
 
-int create_config_file (char* file) {
+int create_config_file (const char* file) {
 	FILE* fd;
 
 	fd = fopen(file, "w");
@@ -47,11 +88,87 @@ int create_config_file (char* file) {
 	fprintf(fd, "rightclick_range=%d\n", default_config.rightclick_range);
 	fprintf(fd, "# direction: 0 = normal, 1 = invert X, 2 = invert Y, 4 = swap X with Y\n");
 	fprintf(fd, "direction=%d\n", default_config.direction);
+	fprintf(fd, "# live_direction=1 lets 'opengalax -d' change the direction at run time\n");
+	fprintf(fd, "live_direction=%d\n", default_config.live_direction);
+	fprintf(fd, "# size of the whole (multi-head) screen in pixels, and the region of it\n");
+	fprintf(fd, "# covered by the panel; touches are mapped onto that region (0 = off,\n");
+	fprintf(fd, "# a map_width or map_height of 0 extends the region to the screen edge)\n");
+	fprintf(fd, "screen_width=%d\n", default_config.screen_width);
+	fprintf(fd, "screen_height=%d\n", default_config.screen_height);
+	fprintf(fd, "map_x=%d\n", default_config.map_x);
+	fprintf(fd, "map_y=%d\n", default_config.map_y);
+	fprintf(fd, "map_width=%d\n", default_config.map_width);
+	fprintf(fd, "map_height=%d\n", default_config.map_height);
 	fprintf(fd, "# set psmouse=1 if you have a mouse connected into the same port\n");
 	fprintf(fd, "# this usually requires i8042.nomux=1 and i8042.reset kernel parameters\n");
 	fprintf(fd, "psmouse=%d\n", default_config.psmouse);
+	fprintf(fd, "# palm and edge rejection, 0 = disabled\n");
+	fprintf(fd, "# edge margins are measured inwards from the calibration values\n");
+	fprintf(fd, "edge_left=%d\n", default_config.edge_left);
+	fprintf(fd, "edge_right=%d\n", default_config.edge_right);
+	fprintf(fd, "edge_top=%d\n", default_config.edge_top);
+	fprintf(fd, "edge_bottom=%d\n", default_config.edge_bottom);
+	fprintf(fd, "# ignore jumps bigger than this between two samples of the same press\n");
+	fprintf(fd, "jump_max=%d\n", default_config.jump_max);
+	fprintf(fd, "# ignore presses shorter than this (ms)\n");
+	fprintf(fd, "min_press_duration=%d\n", default_config.min_press_duration);
+	fprintf(fd, "# press/release chatter of light touches (ms, 0 = disabled): the release of\n");
+	fprintf(fd, "# a press shorter than debounce_press (debounce_release if that is 0) is\n");
+	fprintf(fd, "# reported debounce_release ms late and dropped if the touch goes on, presses\n");
+	fprintf(fd, "# within debounce_press ms of a release must last that long. Both only\n");
+	fprintf(fd, "# within debounce_range of the release (0 = anywhere)\n");
+	fprintf(fd, "debounce_press=%d\n", default_config.debounce_press);
+	fprintf(fd, "debounce_release=%d\n", default_config.debounce_release);
+	fprintf(fd, "debounce_range=%d\n", default_config.debounce_range);
+	fprintf(fd, "# prevent accidental dragging: the pointer stays where the finger landed\n");
+	fprintf(fd, "# until it moves this far away, or touchdown_timeout ms pass (0 = never)\n");
+	fprintf(fd, "touchdown_threshold=%d\n", default_config.touchdown_threshold);
+	fprintf(fd, "touchdown_timeout=%d\n", default_config.touchdown_timeout);
+	fprintf(fd, "# release the buttons when no frame arrives for liftoff_factor report\n");
+	fprintf(fd, "# intervals, and at least liftoff_min ms (liftoff_factor=0 disables)\n");
+	fprintf(fd, "liftoff_factor=%d\n", default_config.liftoff_factor);
+	fprintf(fd, "liftoff_min=%d\n", default_config.liftoff_min);
+	fprintf(fd, "# threaded=1 reads the panel and writes to uinput from separate threads\n");
+	fprintf(fd, "threaded=%d\n", default_config.threaded);
+	fprintf(fd, "# io_uring=1 reads the panel and writes to uinput through io_uring\n");
+	fprintf(fd, "io_uring=%d\n", default_config.io_uring);
+	fprintf(fd, "# the kernel drops moves smaller than fuzz (noise) and reports\n");
+	fprintf(fd, "# moves within flat of the center as the center, 0 = disabled.\n");
+	fprintf(fd, "# calibration mode (-c) suggests fuzz values for your panel\n");
+	fprintf(fd, "fuzz_x=%d\n", default_config.fuzz_x);
+	fprintf(fd, "fuzz_y=%d\n", default_config.fuzz_y);
+	fprintf(fd, "flat_x=%d\n", default_config.flat_x);
+	fprintf(fd, "flat_y=%d\n", default_config.flat_y);
+	fprintf(fd, "# physical resolution in units/mm, 0 = unknown\n");
+	fprintf(fd, "resolution_x=%d\n", default_config.resolution_x);
+	fprintf(fd, "resolution_y=%d\n", default_config.resolution_y);
+	fprintf(fd, "# panel report rate (10, 20, 40, 60, 80, 100 or 200 reports/s) and\n");
+	fprintf(fd, "# resolution (0 to 3 = 1, 2, 4 or 8 counts/mm, -1 = panel default)\n");
+	fprintf(fd, "sample_rate=%d\n", default_config.sample_rate);
+	fprintf(fd, "sample_resolution=%d\n", default_config.sample_resolution);
+	fprintf(fd, "# switch the panel to idle_rate when not touched for idle_timeout ms,\n");
+	fprintf(fd, "# back to sample_rate on touch-down (idle_rate=0 disables)\n");
+	fprintf(fd, "idle_rate=%d\n", default_config.idle_rate);
+	fprintf(fd, "idle_timeout=%d\n", default_config.idle_timeout);
+	fprintf(fd, "# coordinate resolution of the controller: 11, 12 or 14 bits, 0 = detect\n");
+	fprintf(fd, "# (the uinput axes at the full range of the calibration then span 0..16383)\n");
+	fprintf(fd, "panel_bits=%d\n", default_config.panel_bits);
+	fprintf(fd, "# shm_ring=1 also publishes the samples in shared memory for local\n");
+	fprintf(fd, "# clients, through the control socket (see opengalax-ring.h)\n");
+	fprintf(fd, "shm_ring=%d\n", default_config.shm_ring);
+	fprintf(fd, "# inject=1 accepts synthetic touches on the control socket\n");
+	fprintf(fd, "inject=%d\n", default_config.inject);
+	fprintf(fd, "# trace=1 records the time spent in each stage of the last frames and\n");
+	fprintf(fd, "# writes it to /var/log/opengalax-trace.json on SIGUSR2 and on exit\n");
+	fprintf(fd, "trace=%d\n", default_config.trace);
+	fprintf(fd, "# capture the panel traffic to this file, for opengalax-replay (empty = off)\n");
+	fprintf(fd, "capture=%s\n", default_config.capture);
+	fprintf(fd, "# recorder=1 keeps the last minutes of panel traffic in memory and writes\n");
+	fprintf(fd, "# them to /var/log/opengalax-recorder-N.cap on errors and on SIGUSR2\n");
+	fprintf(fd, "recorder=%d\n", default_config.recorder);
 	fprintf(fd, "\n#### calibration data:\n");
-	fprintf(fd, "# - values should range from 0 to 2047\n");
+	fprintf(fd, "# - values should range from 0 to 2047 (4095 or 16383 on 12 and 14 bit panels,\n");
+	fprintf(fd, "#   2047 follows the detected resolution)\n");
 	fprintf(fd, "# - right/bottom must be bigger than left/top\n");
 	fprintf(fd, "# left edge value:\n");
 	fprintf(fd, "xmin=%d\n", default_calibration.xmin);
@@ -61,145 +178,245 @@ int create_config_file (char* file) {
 	fprintf(fd, "ymin=%d\n", default_calibration.ymin);
 	fprintf(fd, "# bottom edge value:\n");
 	fprintf(fd, "ymax=%d\n", default_calibration.ymax);
+	fprintf(fd, "# nonlinearity correction, written by mesh calibration (-m): mesh_size\n");
+	fprintf(fd, "# points per side, then one mesh= line per row of dx,dy corrections\n");
+	fprintf(fd, "mesh_size=%d\n", default_calibration.mesh_size);
 	fprintf(fd, "\n");
 
 	fclose(fd);
 	return 1;
 }
 
-conf_data config_parse (void) {
+/*
+ * Every key of the configuration file, with the structure and the offset
+ * of the field it is stored into. Adding a key only needs a new line here.
+ */
 
-	char file[MAXLEN];
-	char input[MAXLEN], temp[MAXLEN];
-	FILE *fd;
-	size_t len;
-	conf_data config = default_config;
+#define KEY_STR 0
+#define KEY_INT 1
+#define KEY_MESH 2
 
-	sprintf( file, "%s", CONFIG_FILE);
-	if (!file_exists(file)) {
-		if (!create_config_file(file)) {
-			fprintf (stderr,"Failed to create default config file: %s\n", file);
-			exit (1);
-		}
-	}
+#define CONF_STR(k) { #k "=", sizeof (#k), KEY_STR, 0, offsetof (conf_data, k), sizeof (((conf_data *)0)->k) }
+#define CONF_INT(k) { #k "=", sizeof (#k), KEY_INT, 0, offsetof (conf_data, k), 0 }
+#define CALIB_INT(k) { #k "=", sizeof (#k), KEY_INT, 1, offsetof (calibration_data, k), 0 }
 
-	fd = fopen (file, "r");
-	if (fd == NULL) {
-		fprintf (stderr,"Could not open configuration file: %s\n", file);
-		exit (1);
-	}
-
-	while ((fgets (input, sizeof (input), fd)) != NULL) {
+static const struct {
+	const char *key;
+	size_t len;
+	int type;
+	int calibration;
+	size_t offset;
+	size_t size;
+} config_keys[] = {
+	CONF_STR(serial_device),
+	CONF_STR(uinput_device),
+	CONF_INT(rightclick_enable),
+	CONF_INT(rightclick_duration),
+	CONF_INT(rightclick_range),
+	CONF_INT(direction),
+	CONF_INT(live_direction),
+	CONF_INT(screen_width),
+	CONF_INT(screen_height),
+	CONF_INT(map_x),
+	CONF_INT(map_y),
+	CONF_INT(map_width),
+	CONF_INT(map_height),
+	CONF_INT(psmouse),
+	CONF_INT(edge_left),
+	CONF_INT(edge_right),
+	CONF_INT(edge_top),
+	CONF_INT(edge_bottom),
+	CONF_INT(jump_max),
+	CONF_INT(min_press_duration),
+	CONF_INT(debounce_press),
+	CONF_INT(debounce_release),
+	CONF_INT(debounce_range),
+	CONF_INT(touchdown_threshold),
+	CONF_INT(touchdown_timeout),
+	CONF_INT(liftoff_factor),
+	CONF_INT(liftoff_min),
+	CONF_INT(threaded),
+	CONF_INT(io_uring),
+	CONF_INT(fuzz_x),
+	CONF_INT(fuzz_y),
+	CONF_INT(flat_x),
+	CONF_INT(flat_y),
+	CONF_INT(resolution_x),
+	CONF_INT(resolution_y),
+	CONF_INT(sample_rate),
+	CONF_INT(sample_resolution),
+	CONF_INT(idle_rate),
+	CONF_INT(idle_timeout),
+	CONF_INT(panel_bits),
+	CONF_INT(shm_ring),
+	CONF_INT(inject),
+	CONF_INT(trace),
+	CONF_STR(capture),
+	CONF_INT(recorder),
+	CALIB_INT(xmin),
+	CALIB_INT(xmax),
+	CALIB_INT(ymin),
+	CALIB_INT(ymax),
+	CALIB_INT(mesh_size),
+	{ "mesh=", sizeof ("mesh"), KEY_MESH, 1, 0, 0 },
+};
 
-		if ((strncmp ("serial_device=", input, 14)) == 0) {
-			strncpy (temp, input + 14,MAXLEN-1);
-			len=strlen(temp);
-			temp[len-1]='\0';
-			sprintf(config.serial_device, "%s", temp);
-			memset (temp, 0, sizeof (temp));
-		}
+/* one mesh= line: the dx,dy pairs of a row, left to right */
+static void config_mesh_row (calibration_data *calibration, int row, char *value) {
 
-		if ((strncmp ("uinput_device=", input, 14)) == 0) {
-			strncpy (temp, input + 14,MAXLEN-1);
-			len=strlen(temp);
-			temp[len-1]='\0';
-			sprintf(config.uinput_device, "%s", temp);
-			memset (temp, 0, sizeof (temp));
-		}
+	char *end;
+	int i;
 
-		if ((strncmp ("rightclick_enable=", input, 18)) == 0) {
-			strncpy (temp, input + 18,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			config.rightclick_enable = atoi(temp);
-		}
+	if (row >= MESH_MAX)
+		return;
 
-		if ((strncmp ("rightclick_duration=", input, 20)) == 0) {
-			strncpy (temp, input + 20,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			config.rightclick_duration = atoi(temp);
-		}
+	for (i = 0; i < MESH_MAX; i++) {
+		calibration->mesh[row][i][0] = strtol (value, &end, 10);
+		if (end == value || *end != ',')
+			break;
+		value = end + 1;
+		calibration->mesh[row][i][1] = strtol (value, &end, 10);
+		value = end;
+	}
+}
 
-		if ((strncmp ("rightclick_range=", input, 17)) == 0) {
-			strncpy (temp, input + 17,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			config.rightclick_range = atoi(temp);
-		}
+/* report rates the panel accepts, anything else is NAKed and init fails */
+static int config_rate_valid (int rate) {
+	return rate == 10 || rate == 20 || rate == 40 || rate == 60 ||
+	       rate == 80 || rate == 100 || rate == 200;
+}
 
-		if ((strncmp ("direction=", input, 10)) == 0) {
-			strncpy (temp, input + 10,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			config.direction = atoi(temp);
-		}
+/* values sent to the panel as they are, a bad one would fail every init */
+static void config_check_panel (conf_data *config) {
 
-		if ((strncmp ("psmouse=", input, 8)) == 0) {
-			strncpy (temp, input + 8,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			config.psmouse = atoi(temp);
-		}
+	if (!config_rate_valid (config->sample_rate)) {
+		fprintf (stderr, "Invalid sample_rate=%d, using %d\n", config->sample_rate, default_config.sample_rate);
+		config->sample_rate = default_config.sample_rate;
+	}
+	if (config->idle_rate != 0 && !config_rate_valid (config->idle_rate)) {
+		fprintf (stderr, "Invalid idle_rate=%d, idle rate disabled\n", config->idle_rate);
+		config->idle_rate = 0;
+	}
+	if (config->sample_resolution < -1 || config->sample_resolution > 3) {
+		fprintf (stderr, "Invalid sample_resolution=%d, using %d\n", config->sample_resolution, default_config.sample_resolution);
+		config->sample_resolution = default_config.sample_resolution;
 	}
-
-	fclose(fd);
-	return config;
 }
 
-calibration_data calibration_parse (void) {
+/*
+ * config_load() reads the configuration and calibration data in a single
+ * pass over the config file, parsing every line in place.
+ */
+void config_load (conf_data *config, calibration_data *calibration) {
 
-	char file[MAXLEN];
-	char input[MAXLEN], temp[MAXLEN];
+	char input[MAXLEN];
+	char *value;
 	FILE *fd;
-	size_t len;
-	calibration_data calibration = default_calibration;
+	size_t i, len;
+	int rows = 0;
+
+	*config = default_config;
+	*calibration = default_calibration;
 
-	sprintf( file, "%s", CONFIG_FILE);
-	if (!file_exists(file)) {
-		if (!create_config_file(file)) {
-			fprintf (stderr,"Failed to create default config file: %s\n", file);
+	if (!file_exists(CONFIG_FILE)) {
+		if (!create_config_file(CONFIG_FILE)) {
+			fprintf (stderr,"Failed to create default config file: %s\n", CONFIG_FILE);
 			exit (1);
 		}
 	}
 
-	fd = fopen (file, "r");
+	fd = fopen (CONFIG_FILE, "r");
 	if (fd == NULL) {
-		fprintf (stderr,"Could not open configuration file: %s\n", file);
+		fprintf (stderr,"Could not open configuration file: %s\n", CONFIG_FILE);
 		exit (1);
 	}
 
 	while ((fgets (input, sizeof (input), fd)) != NULL) {
 
-		if ((strncmp ("xmin=", input, 5)) == 0) {
-			strncpy (temp, input + 5,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			calibration.xmin = atoi(temp);
-		}
+		for (i = 0; i < sizeof (config_keys) / sizeof (config_keys[0]); i++) {
 
-		if ((strncmp ("xmax=", input, 5)) == 0) {
-			strncpy (temp, input + 5,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			calibration.xmax = atoi(temp);
-		}
+			if (strncmp (config_keys[i].key, input, config_keys[i].len) != 0)
+				continue;
 
-		if ((strncmp ("ymin=", input, 5)) == 0) {
-			strncpy (temp, input + 5,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			calibration.ymin = atoi(temp);
-		}
+			value = input + config_keys[i].len;
+			len = strcspn (value, "\r\n");
+			value[len] = '\0';
 
-		if ((strncmp ("ymax=", input, 5)) == 0) {
-			strncpy (temp, input + 5,MAXLEN-1);
-			len=strlen(temp);
-			temp[len+1]='\0';
-			calibration.ymax = atoi(temp);
+			if (config_keys[i].type == KEY_MESH)
+				config_mesh_row (calibration, rows++, value);
+			else if (config_keys[i].calibration)
+				*(int *)((char *)calibration + config_keys[i].offset) = atoi(value);
+			else if (config_keys[i].type == KEY_INT)
+				*(int *)((char *)config + config_keys[i].offset) = atoi(value);
+			else
+				snprintf ((char *)config + config_keys[i].offset, config_keys[i].size, "%s", value);
+			break;
 		}
 	}
 
 	fclose(fd);
-	return calibration;
+
+	config_check_panel (config);
+
+	if (calibration->mesh_size != 0 && (calibration->mesh_size < MESH_MIN ||
+	    calibration->mesh_size > MESH_MAX || rows != calibration->mesh_size)) {
+		fprintf (stderr, "Ignoring the nonlinearity mesh: mesh_size=%d with %d mesh= lines\n",
+			 calibration->mesh_size, rows);
+		calibration->mesh_size = 0;
+	}
+}
+
+static void config_write_mesh (FILE *fd, calibration_data *calibration) {
+
+	int row, i;
+
+	fprintf (fd, "mesh_size=%d\n", calibration->mesh_size);
+	for (row = 0; row < calibration->mesh_size; row++) {
+		fprintf (fd, "mesh=");
+		for (i = 0; i < calibration->mesh_size; i++)
+			fprintf (fd, "%s%d,%d", i ? " " : "", calibration->mesh[row][i][0], calibration->mesh[row][i][1]);
+		fprintf (fd, "\n");
+	}
+}
+
+/*
+ * config_save_mesh() replaces the mesh of the config file, keeping every
+ * other line as it is. The file is rewritten to a temporary copy that is
+ * renamed over it, so it is never left half written.
+ */
+int config_save_mesh (calibration_data *calibration) {
+
+	char input[MAXLEN];
+	FILE *in, *out;
+	int written = 0;
+
+	in = fopen (CONFIG_FILE, "r");
+	if (in == NULL)
+		return 0;
+	out = fopen (CONFIG_FILE ".new", "w");
+	if (out == NULL) {
+		fclose (in);
+		return 0;
+	}
+
+	while ((fgets (input, sizeof (input), in)) != NULL) {
+		if (strncmp (input, "mesh=", 5) == 0)
+			continue;
+		if (strncmp (input, "mesh_size=", 10) == 0) {
+			if (!written)
+				config_write_mesh (out, calibration);
+			written = 1;
+			continue;
+		}
+		fputs (input, out);
+	}
+	if (!written)
+		config_write_mesh (out, calibration);
+
+	fclose (in);
+	if (fclose (out) != 0 || rename (CONFIG_FILE ".new", CONFIG_FILE) != 0) {
+		unlink (CONFIG_FILE ".new");
+		return 0;
+	}
+	return 1;
 }
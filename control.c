@@ -0,0 +1,372 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "opengalax.h"
+#include "opengalax-ring.h"
+
+/*
+ * Control socket for local clients. It is served by a thread of its own,
+ * so clients never hold up the main loop: one message per datagram, an
+ * opengalax_msg header followed by its records.
+ */
+
+#define CONTROL_CLIENTS 16
+#define CONTROL_MSG_MAX 4096
+
+static int fd_listen = -1;
+
+/*
+ * Injected touches wait here for the main loop, which is woken up through
+ * fd_wake. head is only written by the control thread, tail by the main
+ * loop. A full queue holds up the client instead of dropping its touches.
+ */
+#define INJECT_QUEUE 1024
+
+static struct opengalax_touch inbox[INJECT_QUEUE];
+static unsigned int inbox_head;
+static unsigned int inbox_tail;
+static int fd_wake = -1;
+static int inject_enabled;
+
+/* direction asked for by a client, -1 once the main loop took it */
+static int live_direction;
+static int direction_next = -1;
+
+static struct {
+	int fd;
+	int ring;		/* ring_subscribe() client, -1 if none */
+} conns[CONTROL_CLIENTS];
+
+/* answer with the header and, if any, descriptors attached */
+static void control_reply (int fd, uint32_t type, uint32_t count, int *fds, int nfds) {
+
+	struct opengalax_msg msg = { .type = type, .count = count };
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof (msg) };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE (2 * sizeof (int))];
+	} cbuf;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		memset (&cbuf, 0, sizeof (cbuf));
+		mh.msg_control = cbuf.buf;
+		mh.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+		cmsg = CMSG_FIRSTHDR (&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (nfds * sizeof (int));
+		memcpy (CMSG_DATA (cmsg), fds, nfds * sizeof (int));
+	}
+
+	if (sendmsg (fd, &mh, MSG_NOSIGNAL) < 0)
+		fprintf (stderr, "control: sendmsg: %s\n", strerror (errno));
+}
+
+static void control_subscribe (int c) {
+
+	int fds[2];
+
+	// no descriptors in the answer: subscribed already, or no room left
+	if (conns[c].ring >= 0 || (conns[c].ring = ring_subscribe (&fds[0], &fds[1])) < 0) {
+		control_reply (conns[c].fd, OPENGALAX_MSG_SUBSCRIBE, 0, NULL, 0);
+		return;
+	}
+
+	control_reply (conns[c].fd, OPENGALAX_MSG_SUBSCRIBE, 0, fds, 2);
+	close (fds[0]);		/* the client has its own copy now */
+}
+
+static void control_wake (void) {
+
+	uint64_t one = 1;
+
+	if (write (fd_wake, &one, sizeof (one)) < 0 && errno != EAGAIN)
+		die ("error: eventfd");
+}
+
+static void control_inject_records (int c, const struct opengalax_touch *touch, uint32_t count) {
+
+	unsigned int head = inbox_head;
+	uint32_t i;
+
+	if (!inject_enabled || count > OPENGALAX_INJECT_MAX) {
+		control_reply (conns[c].fd, OPENGALAX_MSG_INJECT, 0, NULL, 0);
+		return;
+	}
+
+	// the main loop may not drain the inbox for a while, the records that
+	// do not fit are refused rather than waited for
+	for (i = 0; i < count; i++, head++) {
+		if (head - __atomic_load_n (&inbox_tail, __ATOMIC_ACQUIRE) == INJECT_QUEUE)
+			break;
+		inbox[head % INJECT_QUEUE] = touch[i];
+	}
+	__atomic_store_n (&inbox_head, head, __ATOMIC_RELEASE);
+	control_wake ();
+
+	control_reply (conns[c].fd, OPENGALAX_MSG_INJECT, i, NULL, 0);
+}
+
+static void control_set_direction (int c, uint32_t direction) {
+
+	if (!live_direction || direction > 7) {
+		control_reply (conns[c].fd, OPENGALAX_MSG_DIRECTION, 0, NULL, 0);
+		return;
+	}
+
+	__atomic_store_n (&direction_next, direction, __ATOMIC_RELEASE);
+	control_wake ();
+
+	control_reply (conns[c].fd, OPENGALAX_MSG_DIRECTION, 1, NULL, 0);
+}
+
+/* the direction asked for since the last call, or -1 */
+int control_direction (void) {
+	return __atomic_exchange_n (&direction_next, -1, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * control_inject() moves injected touches to the batch, as decode_bytes()
+ * does with frames: raw ones still need transform.batch(), the others only
+ * transform_clip(). Returns 1 for raw touches, 0 for screen coordinates and
+ * -1 when there is nothing left.
+ */
+int control_inject (sample_batch *batch) {
+
+	unsigned int tail = inbox_tail;
+	unsigned int head = __atomic_load_n (&inbox_head, __ATOMIC_ACQUIRE);
+	const struct opengalax_touch *t;
+	int raw, x, y, n = 0;
+
+	if (tail == head)
+		return -1;
+
+	raw = inbox[tail % INJECT_QUEUE].raw != 0;
+
+	for (; tail != head && n < BATCH_MAX; tail++, n++) {
+		t = &inbox[tail % INJECT_QUEUE];
+		if ((t->raw != 0) != raw)
+			break;
+		batch->click[n] = t->pressed ? PRESS : RELEASE;
+		if (raw) {
+			x = t->x < 0 ? 0 : t->x > AXIS_MAX(PANEL_BITS_MAX) ? AXIS_MAX(PANEL_BITS_MAX) : t->x;
+			y = t->y < 0 ? 0 : t->y > AXIS_MAX(PANEL_BITS_MAX) ? AXIS_MAX(PANEL_BITS_MAX) : t->y;
+			batch->xa[n] = x >> 7;
+			batch->xb[n] = x & XB_MAX;
+			batch->ya[n] = y >> 7;
+			batch->yb[n] = y & YB_MAX;
+		} else {
+			batch->x[n] = t->x;
+			batch->y[n] = t->y;
+		}
+	}
+	batch->count = n;
+
+	__atomic_store_n (&inbox_tail, tail, __ATOMIC_RELEASE);
+	return raw;
+}
+
+static void control_close (int c) {
+
+	// the main loop closes its eventfd
+	if (conns[c].ring >= 0) {
+		ring_unsubscribe (conns[c].ring);
+		control_wake ();
+	}
+	close (conns[c].fd);
+	conns[c].fd = -1;
+	conns[c].ring = -1;
+}
+
+static void control_message (int c) {
+
+	static unsigned char buf[CONTROL_MSG_MAX] __attribute__ ((aligned (8)));
+	struct opengalax_msg msg;
+	ssize_t len;
+
+	len = recv (conns[c].fd, buf, sizeof (buf), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len < (ssize_t) sizeof (msg)) {
+		control_close (c);
+		return;
+	}
+
+	memcpy (&msg, buf, sizeof (msg));
+	switch (msg.type) {
+		case OPENGALAX_MSG_SUBSCRIBE:
+			control_subscribe (c);
+			break;
+		case OPENGALAX_MSG_INJECT:
+			if (msg.count > (len - sizeof (msg)) / sizeof (struct opengalax_touch))
+				msg.count = 0;
+			control_inject_records (c, (const struct opengalax_touch *) (buf + sizeof (msg)), msg.count);
+			break;
+		case OPENGALAX_MSG_DIRECTION:
+			control_set_direction (c, msg.count);
+			break;
+		default:
+			fprintf (stderr, "control: unknown message %u\n", msg.type);
+			break;
+	}
+}
+
+static void control_accept (void) {
+
+	int fd, c;
+
+	fd = accept4 (fd_listen, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	for (c = 0; c < CONTROL_CLIENTS; c++)
+		if (conns[c].fd < 0)
+			break;
+	if (c == CONTROL_CLIENTS) {
+		close (fd);
+		return;
+	}
+
+	conns[c].fd = fd;
+	conns[c].ring = -1;
+}
+
+static void *control_thread (void *arg) {
+
+	struct pollfd pfd[CONTROL_CLIENTS + 1];
+	int map[CONTROL_CLIENTS + 1];
+	int c, n;
+
+	(void) arg;
+
+	while (1) {
+
+		pfd[0].fd = fd_listen;
+		pfd[0].events = POLLIN;
+		for (c = 0, n = 1; c < CONTROL_CLIENTS; c++) {
+			if (conns[c].fd < 0)
+				continue;
+			pfd[n].fd = conns[c].fd;
+			pfd[n].events = POLLIN;
+			map[n++] = c;
+		}
+
+		if (poll (pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die ("error: poll");
+		}
+
+		for (c = 1; c < n; c++)
+			if (pfd[c].revents)
+				control_message (map[c]);
+
+		if (pfd[0].revents & POLLIN)
+			control_accept ();
+	}
+
+	return NULL;
+}
+
+/*
+ * control_init() creates the socket, only root and the group of the
+ * socket (chgrp it for the kiosk user) may connect, and starts the thread.
+ * *fd_control is set to the eventfd that wakes up the main loop when
+ * touches were injected, the direction changed or a ring client left.
+ */
+int control_init (int inject, int direction, int *fd_control) {
+
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int c;
+
+	*fd_control = -1;
+	fd_wake = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd_wake < 0)
+		return -1;
+	*fd_control = fd_wake;
+	inject_enabled = inject;
+	live_direction = direction;
+
+	for (c = 0; c < CONTROL_CLIENTS; c++) {
+		conns[c].fd = -1;
+		conns[c].ring = -1;
+	}
+
+	fd_listen = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd_listen < 0)
+		return -1;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", OPENGALAX_SOCKET);
+
+	// left behind by a crash, the pid file lock says we are the only instance
+	unlink (OPENGALAX_SOCKET);
+
+	if (bind (fd_listen, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+	    chmod (OPENGALAX_SOCKET, 0660) < 0 ||
+	    listen (fd_listen, CONTROL_CLIENTS) < 0) {
+		close (fd_listen);
+		fd_listen = -1;
+		return -1;
+	}
+
+	if (pthread_create (&thread, NULL, control_thread, NULL) != 0)
+		die ("error: pthread_create");
+	pthread_detach (thread);
+
+	return 0;
+}
+
+void control_cleanup (void) {
+	if (fd_listen >= 0)
+		unlink (OPENGALAX_SOCKET);
+}
+
+/* client side of OPENGALAX_MSG_DIRECTION, for opengalax -d */
+int control_send_direction (int direction) {
+
+	struct opengalax_msg msg = { .type = OPENGALAX_MSG_DIRECTION, .count = direction };
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	snprintf (addr.sun_path, sizeof (addr.sun_path), "%s", OPENGALAX_SOCKET);
+
+	if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+	    send (fd, &msg, sizeof (msg), 0) != sizeof (msg) ||
+	    recv (fd, &msg, sizeof (msg), 0) != sizeof (msg)) {
+		close (fd);
+		return -1;
+	}
+
+	close (fd);
+	return msg.count;
+}
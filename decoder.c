@@ -0,0 +1,97 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include "opengalax.h"
+
+/*
+ * bits is the coordinate resolution of the controller, or 0 to infer it
+ * from the frames: the PS/2 protocol has no way to ask the panel, but the
+ * high bytes of 12 and 14 bit controllers soon go past the 11 bit range.
+ */
+void decoder_init (decoder_data *dec, int bits) {
+	memset (dec, 0, sizeof (*dec));
+	dec->detect = (bits == 0);
+	dec->bits = bits ? bits : PANEL_BITS_MIN;
+}
+
+/* drop a partial PDU, keep the detected resolution */
+void decoder_reset (decoder_data *dec) {
+	dec->count = 0;
+}
+
+static void decoder_detect (decoder_data *dec, unsigned char high) {
+
+	// 11, 12 or 14 bits
+	while (high > XA_MAX(dec->bits) && dec->bits < PANEL_BITS_MAX)
+		dec->bits = (dec->bits == 12) ? 14 : dec->bits + 1;
+}
+
+/*
+ * decode_bytes() gathers the bytes read from the serial port into 5 byte
+ * PDUs and appends every complete PDU to the batch. Bytes outside of a PDU
+ * answer a pending panel init command or belong to the PS/2 mouse. Partial
+ * PDUs are kept in the decoder until the next call. Returns the number of
+ * bytes consumed, which is less than len when the batch gets full.
+ */
+int decode_bytes (decoder_data *dec, const unsigned char *buf, int len, sample_batch *batch) {
+
+	int i;
+	unsigned char data;
+	unsigned char *pdu = dec->pdu;
+
+	for (i = 0; i < len && batch->count < BATCH_MAX; i++) {
+
+		data = buf[i];
+
+		// click must be 0x80 (release) or 0x81 (press)
+		if (dec->count == 0) {
+			if (data != RELEASE && data != PRESS) {
+				if (panel_init_byte(data))
+					continue;
+				if (use_psmouse)
+					psmouse_interrupt(data);
+				else {
+					printf ("ERROR: click=%.02X\n", data);
+					recorder_anomaly(RECORDER_CLICK);
+				}
+				continue;
+			}
+		}
+
+		pdu[dec->count++] = data;
+		if (dec->count < 5)
+			continue;
+
+		dec->count = 0;
+
+		if (dec->detect)
+			decoder_detect (dec, pdu[1] > pdu[3] ? pdu[1] : pdu[3]);
+
+		if (pdu[1] > XA_MAX(dec->bits)) printf ("ERROR: xa=%.02X\n", pdu[1]);
+		if (pdu[2] > XB_MAX) printf ("ERROR: xb=%.02X\n", pdu[2]);
+		if (pdu[3] > XA_MAX(dec->bits)) printf ("ERROR: ya=%.02X\n", pdu[3]);
+		if (pdu[4] > YB_MAX) printf ("ERROR: yb=%.02X\n", pdu[4]);
+		if (pdu[1] > XA_MAX(dec->bits) || pdu[2] > XB_MAX || pdu[3] > XA_MAX(dec->bits) || pdu[4] > YB_MAX)
+			recorder_anomaly(RECORDER_PDU);
+
+		if (DEBUG)
+			fprintf (stderr,"PDU: %.2X %.2X %.2X %.2X %.2X\n", pdu[0], pdu[1], pdu[2], pdu[3], pdu[4]);
+
+		batch->click[batch->count] = pdu[0];
+		batch->xa[batch->count] = pdu[1];
+		batch->xb[batch->count] = pdu[2];
+		batch->ya[batch->count] = pdu[3];
+		batch->yb[batch->count] = pdu[4];
+		batch->count++;
+	}
+
+	return i;
+}
@@ -0,0 +1,312 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include "opengalax.h"
+
+/* consecutive oversized jumps accepted as a real relocation of the finger */
+#define JUMP_RELOCATE 3
+
+/* report interval assumed until one is measured, and longest one measured */
+#define LIFTOFF_INTERVAL 10000	/* us */
+#define LIFTOFF_INTERVAL_MAX 100000
+
+void reject_init (reject_data *rej, conf_data *conf) {
+
+	memset (rej, 0, sizeof (*rej));
+
+	rej->jump_max = conf->jump_max;
+	rej->min_press_duration = conf->min_press_duration;
+}
+
+void reject_reset (reject_data *rej) {
+	rej->pressed = 0;
+	rej->confirmed = 0;
+	rej->jumps = 0;
+}
+
+/*
+ * reject_sample() decides if a decoded sample must be dropped before it
+ * reaches the button state machine. Returns 1 when the sample is rejected.
+ * The edge margin test is done by transform_batch(), which sets 'inside'.
+ *
+ * - presses inside the edge margins are ignored (bezel and palm contacts)
+ * - while pressed, jumps bigger than jump_max are ignored
+ * - presses shorter than min_press_duration never reach uinput
+ */
+int reject_sample (reject_data *rej, unsigned char click, int x, int y, int inside, struct timeval *now) {
+
+	int dx, dy;
+
+	if (click == RELEASE) {
+		int emitted = rej->confirmed;
+		reject_reset (rej);
+		// a release is only meaningful if its press went through
+		return !emitted;
+	}
+
+	if (!inside)
+		return 1;
+
+	if (!rej->pressed) {
+		rej->pressed = 1;
+		rej->confirmed = (rej->min_press_duration <= 0);
+		rej->jumps = 0;
+		rej->last_x = x;
+		rej->last_y = y;
+		rej->tv_press = *now;
+	}
+
+	if (rej->jump_max > 0) {
+		dx = x - rej->last_x;
+		dy = y - rej->last_y;
+		if (dx < 0) dx = -dx;
+		if (dy < 0) dy = -dy;
+		if ((dx > rej->jump_max || dy > rej->jump_max) && ++rej->jumps < JUMP_RELOCATE)
+			return 1;
+	}
+
+	rej->jumps = 0;
+	rej->last_x = x;
+	rej->last_y = y;
+
+	if (!rej->confirmed) {
+		if (!time_elapsed_ms (&rej->tv_press, now, rej->min_press_duration))
+			return 1;
+		rej->confirmed = 1;
+	}
+
+	return 0;
+}
+
+void hysteresis_init (hysteresis_data *hys, conf_data *conf) {
+
+	memset (hys, 0, sizeof (*hys));
+
+	hys->threshold = conf->touchdown_threshold;
+	hys->timeout = conf->touchdown_timeout;
+}
+
+/*
+ * hysteresis_sample() keeps the pointer where the finger landed until it
+ * moves more than 'threshold' away from there (or, when set, 'timeout' ms
+ * have passed), which prevents accidental dragging without delaying real
+ * drags. Returns 1 if the position of the sample must be sent.
+ */
+int hysteresis_sample (hysteresis_data *hys, int first_click, int x, int y, struct timeval *now) {
+
+	int dx, dy;
+
+	if (first_click) {
+		hys->locked = (hys->threshold > 0);
+		hys->anchor_x = x;
+		hys->anchor_y = y;
+		hys->tv_down = *now;
+		return 1;
+	}
+
+	if (!hys->locked)
+		return 1;
+
+	dx = x - hys->anchor_x;
+	dy = y - hys->anchor_y;
+	if (dx < 0) dx = -dx;
+	if (dy < 0) dy = -dy;
+
+	if (dx > hys->threshold || dy > hys->threshold ||
+	    (hys->timeout > 0 && time_elapsed_ms (&hys->tv_down, now, hys->timeout))) {
+		hys->locked = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+void debounce_init (debounce_data *db, conf_data *conf) {
+
+	memset (db, 0, sizeof (*db));
+
+	db->press_min = conf->debounce_press;
+	db->release_min = conf->debounce_release;
+	db->range = conf->debounce_range;
+	db->short_max = db->press_min > 0 ? db->press_min : db->release_min;
+}
+
+/* the finger is gone without a release that went through */
+void debounce_reset (debounce_data *db) {
+	db->down = 0;
+	db->held = 0;
+	db->confirming = 0;
+}
+
+static int debounce_near (debounce_data *db, int x, int y) {
+
+	int dx = x - db->release_x;
+	int dy = y - db->release_y;
+
+	if (dx < 0) dx = -dx;
+	if (dy < 0) dy = -dy;
+	return db->range <= 0 || (dx <= db->range && dy <= db->range);
+}
+
+/*
+ * debounce_sample() suppresses the PRESS/RELEASE chatter of a light touch
+ * in front of the button state machine. Returns one of DEBOUNCE_*.
+ *
+ * - the release of a press shorter than short_max ms is held back
+ *   release_min ms, a press within 'range' of it in that time cancels it and
+ *   the button stays down. Longer presses are released at once, the chatter
+ *   of their lift-off is left to press_min
+ * - a press within 'range' of a release reported less than press_min ms
+ *   before must last press_min ms, a shorter one is dropped with its release
+ * - any other press goes through at once, clean presses are not delayed
+ */
+int debounce_sample (debounce_data *db, unsigned char click, int x, int y, struct timeval *now) {
+
+	if (click == RELEASE) {
+		if (db->confirming) {
+			db->confirming = 0;
+			db->presses++;
+			return DEBOUNCE_DROP;
+		}
+		if (db->held)
+			return DEBOUNCE_DROP;
+		if (db->down && db->release_min > 0 &&
+		    !time_elapsed_ms (&db->tv_press, now, db->short_max)) {
+			db->held = 1;
+			db->release_x = x;
+			db->release_y = y;
+			db->tv_release = *now;
+			return DEBOUNCE_DROP;
+		}
+		db->down = 0;
+		db->release_x = x;
+		db->release_y = y;
+		db->tv_release = *now;
+		return DEBOUNCE_PASS;
+	}
+
+	if (db->held) {
+		db->held = 0;
+		if (debounce_near (db, x, y)) {
+			db->releases++;
+			return DEBOUNCE_PASS;
+		}
+		// a touch somewhere else, the finger really was lifted
+		db->tv_release = *now;
+		db->tv_press = *now;
+		return DEBOUNCE_FLUSH;
+	}
+
+	if (db->down)
+		return DEBOUNCE_PASS;
+
+	if (!db->confirming) {
+		if (db->press_min <= 0 || time_elapsed_ms (&db->tv_release, now, db->press_min) ||
+		    !debounce_near (db, x, y)) {
+			db->down = 1;
+			db->tv_press = *now;
+			return DEBOUNCE_PASS;
+		}
+		db->confirming = 1;
+		db->tv_confirm = *now;
+	}
+
+	if (!time_elapsed_ms (&db->tv_confirm, now, db->press_min))
+		return DEBOUNCE_DROP;
+
+	db->confirming = 0;
+	db->down = 1;
+	db->tv_press = db->tv_confirm;
+	return DEBOUNCE_PASS;
+}
+
+/*
+ * debounce_poll() returns the ms left until the held release is due, 0 when
+ * it is due now (the caller reports it at release_x, release_y), or -1 when
+ * no release is held.
+ */
+int debounce_poll (debounce_data *db, struct timeval *now) {
+
+	int elapsed;
+
+	if (!db->held)
+		return -1;
+
+	elapsed = (now->tv_sec - db->tv_release.tv_sec) * 1000 + (now->tv_usec - db->tv_release.tv_usec) / 1000;
+	if (elapsed < db->release_min)
+		return db->release_min - elapsed;
+
+	db->held = 0;
+	db->down = 0;
+	db->tv_release = *now;
+	return 0;
+}
+
+void liftoff_init (liftoff_data *lo, conf_data *conf) {
+
+	memset (lo, 0, sizeof (*lo));
+
+	lo->factor = conf->liftoff_factor;
+	lo->min = conf->liftoff_min;
+	lo->interval = LIFTOFF_INTERVAL;
+}
+
+/*
+ * liftoff_frame() is called for every PRESS and RELEASE frame received,
+ * rejected or not, and keeps a running average of the report interval.
+ */
+void liftoff_frame (liftoff_data *lo, unsigned char click, struct timeval *now) {
+
+	int dt;
+
+	if (click != PRESS) {
+		lo->armed = 0;
+		return;
+	}
+
+	dt = (now->tv_sec - lo->tv_last.tv_sec) * 1000000 + (now->tv_usec - lo->tv_last.tv_usec);
+
+	// frames read together share a timestamp, and pauses are not intervals
+	if (dt > 0 && dt < LIFTOFF_INTERVAL_MAX)
+		lo->interval += (dt - lo->interval) / 8;
+
+	lo->tv_last = *now;
+}
+
+/* armed while a button is held down on the uinput device */
+void liftoff_arm (liftoff_data *lo, int pressed) {
+	lo->armed = pressed && lo->factor > 0;
+}
+
+/*
+ * liftoff_poll() returns the ms left until the finger is considered gone
+ * because no frame arrived for 'factor' report intervals (and at least
+ * 'min' ms), 0 when that happened, or -1 when not armed. It stays armed,
+ * touch_timeout() decides once the frames that may be waiting were read.
+ */
+int liftoff_poll (liftoff_data *lo, struct timeval *now) {
+
+	int window, elapsed;
+
+	if (!lo->armed)
+		return -1;
+
+	window = lo->factor * lo->interval / 1000;
+	if (window < lo->min)
+		window = lo->min;
+
+	elapsed = (now->tv_sec - lo->tv_last.tv_sec) * 1000 + (now->tv_usec - lo->tv_last.tv_usec) / 1000;
+
+	if (elapsed >= window)
+		return 0;
+
+	return window - elapsed;
+}
@@ -11,8 +11,18 @@
 
 #define DEFAULT_PID_FILE "/var/run/opengalax.pid"
 
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/signalfd.h>
 #include "opengalax.h"
 
+int fd_serial, fd_uinput;
+struct uinput_user_dev uidev;
+int use_psmouse;
+
+/* uinput backend, write_events() unless io_uring is in use */
+void (*uinput_write) (int fd, const struct input_event *ev, int count) = write_events;
+
 int running_as_root (void) {
 	uid_t uid, euid;	
 	uid = getuid();
@@ -31,10 +41,44 @@ int time_elapsed_ms (struct timeval *start, struct timeval *end, int ms) {
 	return 0;
 }
 
-int configure_uinput (void) {
+/* legacy device setup, for kernels without UI_DEV_SETUP (before 4.5) */
+static void configure_uinput_legacy (conf_data *conf, int xmin, int xmax, int ymin, int ymax) {
+
+	memset (&uidev, 0, sizeof (uidev));
+	snprintf (uidev.name, UINPUT_MAX_NAME_SIZE, "opengalax");
+	uidev.id.bustype = BUS_I8042;
+	uidev.id.vendor = 0xeef;
+	uidev.id.product = 0x1;
+	uidev.id.version = 1;
+	uidev.absmin[ABS_X] = xmin;
+	uidev.absmax[ABS_X] = xmax;
+	uidev.absmin[ABS_Y] = ymin;
+	uidev.absmax[ABS_Y] = ymax;
+	// no resolution here
+	uidev.absfuzz[ABS_X] = conf->fuzz_x;
+	uidev.absfuzz[ABS_Y] = conf->fuzz_y;
+	uidev.absflat[ABS_X] = conf->flat_x;
+	uidev.absflat[ABS_Y] = conf->flat_y;
+
+	if (write (fd_uinput, &uidev, sizeof (uidev)) < 0)
+		die ("error: write");
+}
+
+/*
+ * The fuzz values make the input core drop changes smaller than the panel
+ * noise before any reader is woken up, flat is the dead zone around the
+ * axis center, and the resolution (units/mm) lets clients know the real
+ * size of the screen.
+ */
+int configure_uinput (conf_data *conf, calibration_data *calibration) {
 
-	calibration_data calibration;
-	calibration = calibration_parse();
+#ifdef UI_DEV_SETUP
+	struct uinput_setup setup;
+	struct uinput_abs_setup abs;
+#endif
+	int xmin, xmax, ymin, ymax;
+
+	transform_range (conf, calibration, &xmin, &xmax, &ymin, &ymax);
 
 	if (ioctl (fd_uinput, UI_SET_EVBIT, EV_KEY) < 0)
 		die ("error: ioctl");
@@ -54,26 +98,37 @@ int configure_uinput (void) {
 	if (ioctl (fd_uinput, UI_SET_ABSBIT, ABS_Y) < 0)
 		die ("error: ioctl");
 
+#ifdef UI_DEV_SETUP
+	memset (&setup, 0, sizeof (setup));
+	snprintf (setup.name, UINPUT_MAX_NAME_SIZE, "opengalax");
+	setup.id.bustype = BUS_I8042;
+	setup.id.vendor = 0xeef;
+	setup.id.product = 0x1;
+	setup.id.version = 1;
+
+	if (ioctl (fd_uinput, UI_DEV_SETUP, &setup) == 0) {
+
+		memset (&abs, 0, sizeof (abs));
+		abs.code = ABS_X;
+		abs.absinfo.minimum = xmin;
+		abs.absinfo.maximum = xmax;
+		abs.absinfo.fuzz = conf->fuzz_x;
+		abs.absinfo.flat = conf->flat_x;
+		abs.absinfo.resolution = conf->resolution_x;
+		if (ioctl (fd_uinput, UI_ABS_SETUP, &abs) < 0)
+			die ("error: ioctl");
 
-	memset (&uidev, 0, sizeof (uidev));
-	snprintf (uidev.name, UINPUT_MAX_NAME_SIZE, "opengalax");
-	uidev.id.bustype = BUS_I8042;
-	uidev.id.vendor = 0xeef;
-	uidev.id.product = 0x1;
-	uidev.id.version = 1;
-	/*
-	uidev.absmin[ABS_X] = 0;
-	uidev.absmax[ABS_X] = X_AXIS_MAX-1;
-	uidev.absmin[ABS_Y] = 0;
-	uidev.absmax[ABS_Y] = Y_AXIS_MAX-1;
-	*/
-	uidev.absmin[ABS_X] = calibration.xmin;
-	uidev.absmax[ABS_X] = calibration.xmax;
-	uidev.absmin[ABS_Y] = calibration.ymin;
-	uidev.absmax[ABS_Y] = calibration.ymax;
-
-	if (write (fd_uinput, &uidev, sizeof (uidev)) < 0)
-		die ("error: write");
+		abs.code = ABS_Y;
+		abs.absinfo.minimum = ymin;
+		abs.absinfo.maximum = ymax;
+		abs.absinfo.fuzz = conf->fuzz_y;
+		abs.absinfo.flat = conf->flat_y;
+		abs.absinfo.resolution = conf->resolution_y;
+		if (ioctl (fd_uinput, UI_ABS_SETUP, &abs) < 0)
+			die ("error: ioctl");
+	} else
+#endif
+		configure_uinput_legacy (conf, xmin, xmax, ymin, ymax);
 
 	if (ioctl (fd_uinput, UI_DEV_CREATE) < 0)
 		die ("error: ioctl");
@@ -81,11 +136,11 @@ int configure_uinput (void) {
 	return 0;
 }
 
-int setup_uinput_dev (const char *ui_dev) {
+int setup_uinput_dev (const char *ui_dev, conf_data *conf, calibration_data *calibration) {
 	fd_uinput = open (ui_dev, O_WRONLY | O_NONBLOCK);
 	if (fd_uinput < 0) 
 		die ("error: uinput");
-	return configure_uinput ();
+	return configure_uinput (conf, calibration);
 }
 
 
@@ -101,15 +156,65 @@ int open_serial_port (const char *fd_device) {
 	return 0;
 }
 
+/*
+ * The panel is enabled with the sample rate sequence 10, 100, 200. The
+ * configured sample rate and resolution are set after that, before
+ * reporting is enabled again.
+ */
+#define CMD_SET_RESOLUTION 0xe8
+#define CMD_SET_RATE 0xf3
+#define CMD_ENABLE 0xf4
+#define CMD_DISABLE 0xf5
+
+static unsigned char init_seq[12] = { CMD_DISABLE, CMD_SET_RATE, 0x0a, CMD_SET_RATE, 0x64, CMD_SET_RATE, 0xc8, CMD_ENABLE };
+static int init_len = 8;
+
+/* report rate controller, see panel_rate_poll() */
+static struct {
+	int rate;		/* while touched */
+	int idle_rate;		/* 0 = not adaptive */
+	int idle_timeout;
+	int idle;
+	struct timeval tv_frame;
+	unsigned char cmd[2];
+} panel_rate;
+
+void panel_setup (conf_data *conf) {
+
+	init_len = 0;
+	init_seq[init_len++] = CMD_DISABLE;
+	init_seq[init_len++] = CMD_SET_RATE;
+	init_seq[init_len++] = 0x0a;
+	init_seq[init_len++] = CMD_SET_RATE;
+	init_seq[init_len++] = 0x64;
+	init_seq[init_len++] = CMD_SET_RATE;
+	init_seq[init_len++] = 0xc8;
+	if (conf->sample_rate != 200) {
+		init_seq[init_len++] = CMD_SET_RATE;
+		init_seq[init_len++] = conf->sample_rate;
+	}
+	if (conf->sample_resolution >= 0) {
+		init_seq[init_len++] = CMD_SET_RESOLUTION;
+		init_seq[init_len++] = conf->sample_resolution;
+	}
+	init_seq[init_len++] = CMD_ENABLE;
+
+	panel_rate.rate = conf->sample_rate;
+	panel_rate.idle_rate = conf->idle_rate;
+	panel_rate.idle_timeout = conf->idle_timeout;
+	panel_rate.idle = 0;
+	gettimeofday (&panel_rate.tv_frame, NULL);
+}
+
 int init_panel (void) {
 
 	int i;
 	unsigned char r;
 	ssize_t res;
-	unsigned char init_seq[8] = { 0xf5, 0xf3, 0x0a, 0xf3, 0x64, 0xf3, 0xc8, 0xf4 };
 	int ret=1;
+	struct timespec ts;
 
-	for (i=0;i<8;i++) {
+	for (i=0;i<init_len;i++) {
 
 		usleep (10000);
 		res = write (fd_serial, &init_seq[i], 1);
@@ -118,6 +223,11 @@ int init_panel (void) {
 		if (res < 0)
 			die ("error reading from serial port");
 
+		if (recorder_enabled) {
+			clock_gettime (CLOCK_MONOTONIC, &ts);
+			recorder_raw (&r, 1, &ts);
+		}
+
 		if (DEBUG)
 			printf ("SENT: %.02X READ: %.02X\n", init_seq[i], r);
 
@@ -131,9 +241,8 @@ int init_panel (void) {
 	return ret;
 }
 
-void initialize_panel (int sig) {
+void initialize_panel (void) {
 
-	(void) sig;
 	int init_ok=0, i;
 
 	// panel initialization
@@ -145,6 +254,8 @@ void initialize_panel (int sig) {
 
 	if (!init_ok) {
 		fprintf(stderr, "error: failed to initialize panel\n");
+		recorder_anomaly(RECORDER_INIT);
+		recorder_dump("init_failed");
 		remove_pid_file();
 		if (ioctl (fd_uinput, UI_DEV_DESTROY) < 0)
 			die ("error: ioctl");
@@ -154,6 +265,235 @@ void initialize_panel (int sig) {
 	}
 }
 
+/*
+ * Asynchronous panel commands, used for the init sequence on resume and for
+ * report rate changes: the command bytes are sent one at a time from the
+ * main loop, each byte when the previous one has been acknowledged, so
+ * touch frames keep being processed.
+ */
+
+#define INIT_BYTE_TIMEOUT 100	/* ms */
+#define INIT_TRIES 10
+
+static struct {
+	const unsigned char *seq;
+	int len;
+	int step;		/* next byte of seq to be acked, -1 when idle */
+	int tries;
+	struct timeval tv_sent;
+} panel_init = { NULL, 0, -1, 0, { 0, 0 } };
+
+static void panel_init_send (void) {
+	if (write (fd_serial, &panel_init.seq[panel_init.step], 1) != 1)
+		die ("error writing to serial port");
+	gettimeofday (&panel_init.tv_sent, NULL);
+}
+
+static void panel_command (const unsigned char *seq, int len) {
+	panel_init.seq = seq;
+	panel_init.len = len;
+	panel_init.step = 0;
+	panel_init.tries = 1;
+	panel_init_send();
+}
+
+void panel_init_start (void) {
+	// the init sequence leaves the panel at the touch rate
+	panel_rate.idle = 0;
+	gettimeofday (&panel_rate.tv_frame, NULL);
+	panel_command(init_seq, init_len);
+}
+
+int panel_init_active (void) {
+	return panel_init.step >= 0;
+}
+
+static void panel_init_retry (void) {
+	recorder_anomaly(RECORDER_INIT);
+	if (panel_init.tries++ >= INIT_TRIES) {
+		if (panel_init.seq == init_seq)
+			fprintf(stderr, "error: failed to initialize panel\n");
+		else
+			fprintf(stderr, "error: panel command failed\n");
+		panel_init.step = -1;
+		return;
+	}
+	panel_init.step = 0;
+	panel_init_send();
+}
+
+/*
+ * panel_init_byte() is fed every byte found outside of a PDU. Returns 1 if
+ * the byte was the answer to an init command.
+ */
+int panel_init_byte (unsigned char data) {
+
+	if (panel_init.step < 0)
+		return 0;
+
+	if (DEBUG)
+		printf ("SENT: %.02X READ: %.02X\n", panel_init.seq[panel_init.step], data);
+
+	if (data != CMD_OK) {
+		fprintf (stderr,"panel initialization failed: 0x%.02X != 0x%.02X\n", data, CMD_OK);
+		panel_init_retry();
+		return 1;
+	}
+
+	if (++panel_init.step == panel_init.len) {
+		panel_init.step = -1;
+		return 1;
+	}
+
+	panel_init_send();
+	return 1;
+}
+
+/*
+ * panel_init_poll() handles lost acks. Returns the ms until the next
+ * deadline, or -1 when no initialization is in progress.
+ */
+int panel_init_poll (struct timeval *now) {
+
+	int elapsed;
+
+	if (panel_init.step < 0)
+		return -1;
+
+	elapsed = (now->tv_sec - panel_init.tv_sent.tv_sec) * 1000 +
+		  (now->tv_usec - panel_init.tv_sent.tv_usec) / 1000;
+
+	if (elapsed >= INIT_BYTE_TIMEOUT) {
+		panel_init_retry();
+		return panel_init.step < 0 ? -1 : INIT_BYTE_TIMEOUT;
+	}
+
+	return INIT_BYTE_TIMEOUT - elapsed;
+}
+
+/*
+ * Adaptive report rate: once no frame arrived for idle_timeout ms the panel
+ * is switched to idle_rate, which cuts interrupts and wakeups while nobody
+ * touches the screen, and the first frame of the next touch switches it
+ * back to the full rate. The rate changes go through panel_command().
+ */
+static void panel_rate_set (int rate) {
+	panel_rate.cmd[0] = CMD_SET_RATE;
+	panel_rate.cmd[1] = rate;
+	panel_command(panel_rate.cmd, 2);
+}
+
+/* called for every batch of frames received */
+void panel_rate_frame (struct timeval *now) {
+
+	panel_rate.tv_frame = *now;
+
+	// the PS/2 mouse shares the line, its commands go first
+	if (panel_rate.idle && !panel_init_active() && !(use_psmouse && psmouse_busy())) {
+		panel_rate.idle = 0;
+		panel_rate_set(panel_rate.rate);
+	}
+}
+
+/*
+ * panel_rate_poll() lowers the rate when the panel went idle. Returns the
+ * ms until that happens, or -1 when there is nothing to wait for.
+ */
+int panel_rate_poll (struct timeval *now) {
+
+	int elapsed;
+
+	if (panel_rate.idle_rate <= 0 || panel_rate.idle)
+		return -1;
+
+	// a command is in progress, panel_init_poll() or psmouse_poll() has the deadline
+	if (panel_init_active() || (use_psmouse && psmouse_busy()))
+		return -1;
+
+	elapsed = (now->tv_sec - panel_rate.tv_frame.tv_sec) * 1000 +
+		  (now->tv_usec - panel_rate.tv_frame.tv_usec) / 1000;
+
+	if (elapsed >= panel_rate.idle_timeout) {
+		panel_rate.idle = 1;
+		panel_rate_set(panel_rate.idle_rate);
+		return -1;
+	}
+
+	return panel_rate.idle_timeout - elapsed;
+}
+
+/*
+ * Drop whatever the panel sent before or during suspend, it belongs to
+ * touches that are long gone.
+ */
+void flush_serial_port (void) {
+
+	unsigned char buf[256];
+	int flags;
+
+	flags = fcntl (fd_serial, F_GETFL);
+	fcntl (fd_serial, F_SETFL, flags | O_NONBLOCK);
+	while (read (fd_serial, buf, sizeof (buf)) > 0)
+		;
+	fcntl (fd_serial, F_SETFL, flags);
+}
+
+/*
+ * CLOCK_BOOTTIME keeps counting during suspend while CLOCK_MONOTONIC does
+ * not, so a growing gap between them means we just resumed.
+ */
+int system_resumed (void) {
+
+	static long long last_gap = -1;
+	struct timespec boot, mono;
+	long long gap;
+	int resumed;
+
+	clock_gettime (CLOCK_BOOTTIME, &boot);
+	clock_gettime (CLOCK_MONOTONIC, &mono);
+	gap = (boot.tv_sec - mono.tv_sec) * 1000LL + (boot.tv_nsec - mono.tv_nsec) / 1000000;
+
+	resumed = (last_gap >= 0 && gap - last_gap > 500);
+	last_gap = gap;
+	return resumed;
+}
+
+/*
+ * SIGUSR1 (sent by the pm-utils hook on resume), SIGUSR2 (print stats) and
+ * the termination signals are delivered through a signalfd and handled
+ * from the main loop, where writing files out is safe. signal_handler()
+ * only sees them before this is set up.
+ */
+int signal_fd_setup (void) {
+
+	sigset_t mask;
+	int fd;
+
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGUSR1);
+	sigaddset (&mask, SIGUSR2);
+	sigaddset (&mask, SIGINT);
+	sigaddset (&mask, SIGTERM);
+	sigaddset (&mask, SIGHUP);
+	sigaddset (&mask, SIGQUIT);
+	if (sigprocmask (SIG_BLOCK, &mask, NULL) < 0)
+		die ("error: sigprocmask");
+
+	fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		die ("error: signalfd");
+	return fd;
+}
+
+int signal_fd_read (int fd) {
+
+	struct signalfd_siginfo si;
+
+	if (read (fd, &si, sizeof (si)) != sizeof (si))
+		return 0;
+	return si.ssi_signo;
+}
+
 void signal_handler (int sig) {
 
         (void) sig;
@@ -184,108 +524,73 @@ void signal_installer (void) {
 	signal(SIGQUIT, signal_handler);
 	signal(SIGCHLD, signal_handler);
 	signal(SIGABRT, signal_handler);
-	signal(SIGUSR1, initialize_panel);
 }
 
-int file_exists (char *file) {
+int file_exists (const char *file) {
 	struct stat buf;
 	if (stat(file, &buf) == 0)
 		return 1;
 	return 0;
 }
 
-char* default_pid_file (void) {
-	char* file = malloc(strlen(DEFAULT_PID_FILE)+2);
-	sprintf(file, "%s", DEFAULT_PID_FILE);
-	return file;
-}
+/*
+ * The pid file stays open and flock()ed for the whole life of the daemon,
+ * so a running instance is detected by the lock and a stale pid file left
+ * behind by a crash is simply taken over.
+ */
+static int pid_fd = -1;
 
 int create_pid_file (void) {
 
 	int fd;
-	char *pidfile;
-	char buf[100];
-	ssize_t cnt;
-	char* procpid = malloc( sizeof(buf) + 15 );
-
-	pidfile = default_pid_file();
-
-	if (file_exists(pidfile)) {
-
-		// check if /proc/{pid}/cmdline exists and contains opengalax
-		// if it does, means opengalax is already running, so we exit cowardly
-		// if it does not contain opengalax, then we remove the old pid file and continue
-
-		fd = open(pidfile, O_RDONLY);
-		if (fd < 0) {
-			fprintf (stderr,"Could not open pid file: %s\n", pidfile);
-			return 0;
-		}
-		cnt=read(fd, buf, sizeof(buf)-1);
-		buf[cnt]='\0';
-		
-		close(fd);
-
-		strcpy(procpid, "");
-		strcat(procpid, "/proc/");
-		strcat(procpid, buf);
-		strcat(procpid, "/cmdline");
-
-		if (file_exists(procpid)) {
-			fd = open(procpid, O_RDONLY);
-			if (fd < 0) {
-				fprintf (stderr,"Could not open file: %s\n", procpid);
-				return 0;
-			}
-
-			cnt=read(fd, buf, sizeof(buf)-1);
-			buf[cnt]='\0';
-			
-			close(fd);
-
-			if (strstr(buf,"opengalax") != NULL) {
-				fprintf (stderr,"Refusing to start as another instance is already running\n");
-				return 0;
-			} else {
-				if (!remove_pid_file()) 
-					return 0;
-			}
-		}
+	char buf[16];
+	int len;
+
+	fd = open(DEFAULT_PID_FILE, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0 && errno == EEXIST)
+		fd = open(DEFAULT_PID_FILE, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf (stderr,"Could not open pid file: %s\n", DEFAULT_PID_FILE);
+		return 0;
 	}
 
-	fd = open(pidfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (fd < 0 ) {
-		fprintf(stderr,"Could not write pid file: %s\n", pidfile);
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		if (errno == EWOULDBLOCK)
+			fprintf (stderr,"Refusing to start as another instance is already running\n");
+		else
+			perror("Could not lock pid file");
+		close(fd);
 		return 0;
 	}
 
-	sprintf( buf, "%d", getpid() );
-	if (write(fd, buf, strlen(buf)) < 1) {
+	len = snprintf(buf, sizeof(buf), "%d\n", getpid());
+	if (ftruncate(fd, 0) != 0 || write(fd, buf, len) != len) {
 		perror("Something wrong happening while writing pid file");
 		close(fd);
 		return 0;
 	}
-	close(fd);
-
-	free(procpid);
 
+	pid_fd = fd;
 	return 1;
 }
 
 int remove_pid_file (void) {
 
-	char *pidfile;
-
-	pidfile = default_pid_file();
-
-	if (!file_exists(pidfile)) {
-		fprintf (stderr,"pid file does not exist: %s\n", pidfile);
+	if (pid_fd < 0)
 		return 1;
-	}
 
-	if (unlink(pidfile) != 0) {
-		fprintf (stderr,"Could not delete pid file: %s\n", pidfile);
+	if (unlink(DEFAULT_PID_FILE) != 0) {
+		fprintf (stderr,"Could not delete pid file: %s\n", DEFAULT_PID_FILE);
 		return 0;
 	}
+
+	close(pid_fd);
+	pid_fd = -1;
 	return 1;
 }
+
+/* write() a whole report to uinput at once */
+void write_events (int fd, const struct input_event *ev, int count) {
+	if (write (fd, ev, count * sizeof (struct input_event)) < 0)
+		die ("error: write");
+}
@@ -0,0 +1,64 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   fuzz-decoder: libFuzzer harness for the bytes read from the serial
+ *   port. Every input goes through decode_bytes() with a fixed and with a
+ *   detected resolution, and once more with a PS/2 mouse on the same port,
+ *   whose probe the input itself answers. Built by 'make fuzz'.
+ *
+ */
+
+#include <stdint.h>
+#include "opengalax.h"
+#include "psmouse.h"
+
+static void decode_all (decoder_data *dec, const uint8_t *data, size_t size) {
+
+	sample_batch batch;
+	int used;
+
+	while (size > 0) {
+		batch.count = 0;
+		used = decode_bytes (dec, data, size, &batch);
+		data += used;
+		size -= used;
+	}
+}
+
+int LLVMFuzzerInitialize (int *argc, char ***argv) {
+
+	(void) argc;
+	(void) argv;
+
+	// the decoder reports bad frames on stdout, the mouse commands go nowhere
+	if (freopen ("/dev/null", "w", stdout) == NULL)
+		return -1;
+	fd_serial = open ("/dev/null", O_WRONLY);
+	uinput_open ("/dev/null");
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size) {
+
+	decoder_data dec;
+
+	use_psmouse = 0;
+	decoder_init (&dec, PANEL_BITS_MIN);
+	decode_all (&dec, data, size);
+	decoder_init (&dec, 0);
+	decode_all (&dec, data, size);
+
+	use_psmouse = 1;
+	psmouse_connect ();
+	decoder_init (&dec, 0);
+	decode_all (&dec, data, size);
+	psmouse_disconnect ();
+
+	return 0;
+}
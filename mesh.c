@@ -0,0 +1,142 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include "opengalax.h"
+
+/*
+ * Mesh calibration (-m). The user touches a grid of points over the
+ * calibrated area, one at a time. Each point is the average of the samples
+ * of a steady touch, and the difference to where it should be, in panel
+ * values, is the correction that transform_mesh() interpolates between
+ * the points. The samples come in at the full panel range, so the grid
+ * follows the calibration values of the config file.
+ */
+
+#define MESH_SETTLE 200		/* ms of a touch that are not averaged */
+#define MESH_SAMPLES_MIN 10
+
+static calibration_data mesh_calibration;
+static int mesh_direction;
+static int mesh_bits;
+static int mesh_points;
+static int mesh_target;			/* grid point being touched, row by row */
+static struct timeval tv_press;
+static int pressed;
+static long long sum_x, sum_y;
+static int count;
+
+/* screen position of grid point i */
+static void mesh_point (int i, int *x, int *y) {
+
+	calibration_data *c = &mesh_calibration;
+
+	*x = c->xmin + (c->xmax - c->xmin) * (i % mesh_points) / (mesh_points - 1);
+	*y = c->ymin + (c->ymax - c->ymin) * (i / mesh_points) / (mesh_points - 1);
+}
+
+static void mesh_prompt (void) {
+
+	printf ("Touch and hold the point %d%% from the left and %d%% from the top (%d of %d)\n",
+		100 * (mesh_target % mesh_points) / (mesh_points - 1),
+		100 * (mesh_target / mesh_points) / (mesh_points - 1),
+		mesh_target + 1, mesh_points * mesh_points);
+	fflush (stdout);
+}
+
+void mesh_init (calibration_data *calibration, int direction, int bits, int points) {
+
+	mesh_calibration = *calibration;
+	mesh_calibration.mesh_size = 0;
+	mesh_direction = direction;
+	mesh_bits = bits;
+	mesh_points = points;
+	mesh_target = 0;
+	pressed = 0;
+
+	mesh_prompt ();
+}
+
+/* store the correction of the touched point at its place in the mesh */
+static void mesh_store (int x, int y) {
+
+	int tx, ty, tu = 0, tv = 0, mu = 0, mv = 0;
+	int u0, u1, v0, v1, row, col;
+
+	mesh_point (mesh_target, &tx, &ty);
+	transform_raw (mesh_direction, mesh_bits, tx, ty, &tu, &tv);
+	transform_raw (mesh_direction, mesh_bits, x, y, &mu, &mv);
+	transform_raw_box (&mesh_calibration, mesh_direction, mesh_bits, &u0, &u1, &v0, &v1);
+
+	// the mesh is in panel order, the direction may swap or invert the grid
+	col = ((tu - u0) * (mesh_points - 1) + (u1 - u0) / 2) / (u1 - u0);
+	row = ((tv - v0) * (mesh_points - 1) + (v1 - v0) / 2) / (v1 - v0);
+
+	mesh_calibration.mesh[row][col][0] = tu - mu;
+	mesh_calibration.mesh[row][col][1] = tv - mv;
+}
+
+static void mesh_done (void) {
+
+	mesh_calibration.mesh_size = mesh_points;
+	if (config_save_mesh (&mesh_calibration))
+		printf ("\nThe mesh is saved to /etc/opengalax.conf, it is used from the next start.\n");
+	else
+		fprintf (stderr, "\nCould not save the mesh to /etc/opengalax.conf\n");
+	printf ("Press Ctrl+C to exit.\n");
+	fflush (stdout);
+}
+
+void mesh_sample (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now) {
+
+	int tx, ty;
+
+	(void) t;
+	(void) inside;
+
+	if (mesh_target >= mesh_points * mesh_points)
+		return;
+
+	if (click == PRESS) {
+		if (!pressed) {
+			pressed = 1;
+			tv_press = *now;
+			sum_x = sum_y = 0;
+			count = 0;
+		}
+		if ((now->tv_sec - tv_press.tv_sec) * 1000 + (now->tv_usec - tv_press.tv_usec) / 1000 < MESH_SETTLE)
+			return;
+		sum_x += x;
+		sum_y += y;
+		count++;
+		return;
+	}
+
+	if (!pressed)
+		return;
+	pressed = 0;
+
+	if (count < MESH_SAMPLES_MIN) {
+		printf ("Too short, hold the finger still a little longer.\n");
+		mesh_prompt ();
+		return;
+	}
+
+	x = sum_x / count;
+	y = sum_y / count;
+	mesh_point (mesh_target, &tx, &ty);
+	printf ("     touched x=%d y=%d, expected x=%d y=%d\n", x, y, tx, ty);
+	mesh_store (x, y);
+
+	if (++mesh_target < mesh_points * mesh_points)
+		mesh_prompt ();
+	else
+		mesh_done ();
+}
@@ -0,0 +1,410 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   opengalax-bench: measures the per-sample cost of the daemon hot paths,
+ *   in ns/sample, with the same objects the daemon is linked from.
+ *
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "opengalax.h"
+#include "opengalax-ring.h"
+
+#define FRAMES_PER_WRITE 8
+
+static long samples = 1000000;
+
+static long long now_ns (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report (const char *name, long long ns, long n) {
+	printf ("%-28s %8.1f ns/sample\n", name, (double) ns / n);
+}
+
+static void fill_frames (unsigned char *buf, int count) {
+
+	int i, x, y;
+
+	for (i = 0; i < count; i++) {
+		x = (i * 37) % 2048;
+		y = (i * 91) % 2048;
+		buf[i * 5] = PRESS;
+		buf[i * 5 + 1] = x >> 7;
+		buf[i * 5 + 2] = x & 0x7F;
+		buf[i * 5 + 3] = y >> 7;
+		buf[i * 5 + 4] = y & 0x7F;
+	}
+}
+
+static void bench_transform (const char *name, int generic, conf_data *conf, calibration_data *calibration) {
+
+	unsigned char buf[BATCH_MAX * 5];
+	decoder_data decoder;
+	transform_data transform;
+	sample_batch batch;
+	long n, sum = 0;
+	long long t0;
+
+	fill_frames (buf, BATCH_MAX);
+	decoder_init (&decoder, PANEL_BITS_MIN);
+	transform_init (&transform, conf, calibration, PANEL_BITS_MIN);
+	if (generic)
+		transform.batch = transform_batch;
+
+	t0 = now_ns ();
+	for (n = 0; n < samples; n += BATCH_MAX) {
+		batch.count = 0;
+		decode_bytes (&decoder, buf, sizeof (buf), &batch);
+		transform.batch (&transform, &batch);
+		sum += batch.x[0];
+	}
+	report (name, now_ns () - t0, n);
+
+	if (sum == 42)
+		printf ("\n");
+}
+
+static void discard_events (int fd, const struct input_event *ev, int count) {
+	(void) fd;
+	(void) ev;
+	(void) count;
+}
+
+/* touch processing only, reports are built but not written anywhere */
+static void bench_touch (const char *name, int generic, conf_data *conf) {
+
+	touch_data touch;
+	struct timeval tv;
+	unsigned char click;
+	long n;
+	long long t0;
+
+	uinput_write = discard_events;
+	touch_init (&touch, conf, 0, 0);
+	if (generic)
+		touch.sample = touch_sample;
+
+	gettimeofday (&tv, NULL);
+
+	t0 = now_ns ();
+	for (n = 0; n < samples; n++) {
+		// 10 ms reports, a release every 64 samples
+		tv.tv_usec += 10000;
+		if (tv.tv_usec >= 1000000) {
+			tv.tv_usec -= 1000000;
+			tv.tv_sec++;
+		}
+		click = (n % 64 == 63) ? RELEASE : PRESS;
+		touch.sample (&touch, click, (n * 7) % 2048, (n * 3) % 2048, 1, &tv);
+	}
+	report (name, now_ns () - t0, n);
+}
+
+/* feeds the pipe like the panel feeds the serial port, a few frames at a time */
+static void *writer (void *arg) {
+
+	unsigned char buf[FRAMES_PER_WRITE * 5];
+	int fd = *(int *) arg;
+	long n;
+
+	fill_frames (buf, FRAMES_PER_WRITE);
+	for (n = 0; n < samples; n += FRAMES_PER_WRITE)
+		if (write (fd, buf, sizeof (buf)) != sizeof (buf))
+			die ("error: write");
+	close (fd);
+	return NULL;
+}
+
+/*
+ * Read, decode, transform and write one X, Y, button, sync report per
+ * sample, through read()/write() or through io_uring.
+ */
+static void bench_io (const char *name, int use_uring, conf_data *conf, calibration_data *calibration) {
+
+	unsigned char buf[BATCH_MAX * 5];
+	unsigned char *data = buf;
+	struct input_event ev[4];
+	decoder_data decoder;
+	transform_data transform;
+	sample_batch batch;
+	pthread_t thread;
+	int fds[2], i, pos, sig;
+	long n = 0;
+	ssize_t res;
+	long long t0;
+
+	if (pipe (fds) < 0)
+		die ("error: pipe");
+
+	fd_serial = fds[0];
+	fd_uinput = open ("/dev/null", O_WRONLY);
+	if (fd_uinput < 0)
+		die ("error: open");
+
+	if (use_uring) {
+		if (uring_init (fd_serial, -1, -1) < 0) {
+			printf ("%-28s not available\n", name);
+			return;
+		}
+		uinput_write = uring_write;
+	} else
+		uinput_write = write_events;
+
+	memset (ev, 0, sizeof (ev));
+	ev[0].type = EV_ABS;
+	ev[0].code = ABS_X;
+	ev[1].type = EV_ABS;
+	ev[1].code = ABS_Y;
+	ev[2].type = EV_KEY;
+	ev[2].code = BTN_LEFT;
+	ev[2].value = 1;
+	ev[3].type = EV_SYN;
+
+	decoder_init (&decoder, PANEL_BITS_MIN);
+	transform_init (&transform, conf, calibration, PANEL_BITS_MIN);
+
+	t0 = now_ns ();
+	if (pthread_create (&thread, NULL, writer, &fds[1]) != 0)
+		die ("error: pthread_create");
+
+	while (1) {
+		if (use_uring)
+			res = uring_wait (&data, -1, &sig);
+		else
+			res = read (fd_serial, buf, sizeof (buf));
+		if (res == 0)
+			break;
+		if (res < 0)
+			continue;
+
+		for (pos = 0; pos < res; ) {
+			batch.count = 0;
+			pos += decode_bytes (&decoder, data + pos, res - pos, &batch);
+			transform_batch (&transform, &batch);
+			for (i = 0; i < batch.count; i++) {
+				ev[0].value = batch.x[i];
+				ev[1].value = batch.y[i];
+				uinput_write (fd_uinput, ev, 4);
+			}
+			n += batch.count;
+		}
+	}
+
+	pthread_join (thread, NULL);
+	report (name, now_ns () - t0, n);
+
+	close (fd_serial);
+	close (fd_uinput);
+}
+
+/* shared memory ring, publishing only */
+static void bench_ring_publish (const char *name, conf_data *conf, calibration_data *calibration) {
+
+	unsigned char buf[BATCH_MAX * 5];
+	decoder_data decoder;
+	transform_data transform;
+	sample_batch batch;
+	struct timespec ts;
+	long n;
+	long long t0;
+
+	fill_frames (buf, BATCH_MAX);
+	decoder_init (&decoder, PANEL_BITS_MIN);
+	transform_init (&transform, conf, calibration, PANEL_BITS_MIN);
+	batch.count = 0;
+	decode_bytes (&decoder, buf, sizeof (buf), &batch);
+	transform.batch (&transform, &batch);
+
+	t0 = now_ns ();
+	for (n = 0; n < samples; n += BATCH_MAX) {
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		ring_publish (&batch, &ts);
+	}
+	report (name, now_ns () - t0, n);
+}
+
+/* what the flight recorder adds to every read */
+static void bench_recorder (const char *name, conf_data *conf, calibration_data *calibration) {
+
+	unsigned char buf[BATCH_MAX * 5];
+	decoder_data decoder;
+	transform_data transform;
+	sample_batch batch;
+	struct timespec ts;
+	long n;
+	long long t0;
+
+	fill_frames (buf, BATCH_MAX);
+	decoder_init (&decoder, PANEL_BITS_MIN);
+	transform_init (&transform, conf, calibration, PANEL_BITS_MIN);
+	batch.count = 0;
+	decode_bytes (&decoder, buf, sizeof (buf), &batch);
+	transform.batch (&transform, &batch);
+	recorder_init ();
+
+	t0 = now_ns ();
+	for (n = 0; n < samples; n += BATCH_MAX) {
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		recorder_raw (buf, sizeof (buf), &ts);
+		recorder_samples (&batch, &ts);
+	}
+	report (name, now_ns () - t0, n);
+}
+
+static const struct opengalax_ring *client_ring;
+static int client_event;
+static long client_rounds;
+static long long client_latency, client_latency_max;
+static long client_read;
+static uint64_t client_next;
+
+/* a client as an application would write it: wait on the eventfd, drain */
+static void *ring_client (void *arg) {
+
+	struct pollfd pfd = { .fd = client_event, .events = POLLIN };
+	struct opengalax_sample s;
+	uint64_t next = client_next, count;
+	long long latency;
+
+	(void) arg;
+
+	while (client_read < client_rounds) {
+		if (poll (&pfd, 1, -1) < 0)
+			die ("error: poll");
+		if (read (client_event, &count, sizeof (count)) < 0)
+			continue;
+		while (opengalax_ring_read (client_ring, &next, &s) > 0) {
+			latency = now_ns () - s.time_ns;
+			client_latency += latency;
+			if (latency > client_latency_max)
+				client_latency_max = latency;
+			__atomic_store_n (&client_read, client_read + 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * From the frame being read to the sample in the hands of another thread
+ * mapping the ring, one sample at a time, the way touches arrive.
+ */
+static void bench_ring_latency (const char *name, conf_data *conf, calibration_data *calibration) {
+
+	unsigned char buf[5];
+	decoder_data decoder;
+	transform_data transform;
+	sample_batch batch;
+	struct timespec ts;
+	pthread_t thread;
+	int fd_map;
+	long n;
+
+	decoder_init (&decoder, PANEL_BITS_MIN);
+	transform_init (&transform, conf, calibration, PANEL_BITS_MIN);
+
+	if (ring_subscribe (&fd_map, &client_event) < 0) {
+		printf ("%-28s not available\n", name);
+		return;
+	}
+	client_ring = mmap (NULL, sizeof (*client_ring), PROT_READ, MAP_SHARED, fd_map, 0);
+	if (client_ring == MAP_FAILED)
+		die ("error: mmap");
+
+	client_rounds = samples / 100 > 1000 ? samples / 100 : 1000;
+	client_next = client_ring->head;
+	if (pthread_create (&thread, NULL, ring_client, NULL) != 0)
+		die ("error: pthread_create");
+
+	for (n = 0; n < client_rounds; n++) {
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		fill_frames (buf, 1);
+		batch.count = 0;
+		decode_bytes (&decoder, buf, sizeof (buf), &batch);
+		transform.batch (&transform, &batch);
+		ring_publish (&batch, &ts);
+		// wait for the client, so every sample wakes it up
+		while (__atomic_load_n (&client_read, __ATOMIC_ACQUIRE) <= n)
+			sched_yield ();
+	}
+
+	pthread_join (thread, NULL);
+	printf ("%-28s %8.1f us mean %8.1f us max\n", name,
+		client_latency / 1000.0 / client_read, client_latency_max / 1000.0);
+}
+
+int main (int argc, char *argv[]) {
+
+	conf_data conf;
+	calibration_data calibration;
+	transform_data transform;
+
+	if (argc > 1)
+		samples = atol (argv[1]);
+	if (samples <= 0) {
+		printf ("Usage: opengalax-bench [samples]\n");
+		exit (1);
+	}
+
+	memset (&conf, 0, sizeof (conf));
+	conf.rightclick_duration = 350;
+	conf.rightclick_range = 10;
+	conf.touchdown_threshold = 10;
+	conf.liftoff_factor = 4;
+	conf.liftoff_min = 20;
+	memset (&calibration, 0, sizeof (calibration));
+	calibration.xmin = 0;
+	calibration.xmax = 2047;
+	calibration.ymin = 0;
+	calibration.ymax = 2047;
+
+	printf ("%ld samples\n", samples);
+	bench_transform ("decode+transform generic", 1, &conf, &calibration);
+	bench_transform ("decode+transform", 0, &conf, &calibration);
+	conf.screen_width = 3840;
+	conf.screen_height = 1080;
+	conf.map_x = 1920;
+	bench_transform ("decode+transform mapped", 0, &conf, &calibration);
+	conf.screen_width = 0;
+	conf.screen_height = 0;
+	conf.map_x = 0;
+	calibration.mesh_size = 5;
+	calibration.mesh[2][2][0] = 12;
+	calibration.mesh[2][2][1] = -7;
+	bench_transform ("decode+transform mesh", 0, &conf, &calibration);
+	calibration.mesh_size = 0;
+	bench_touch ("touch generic", 1, &conf);
+	bench_touch ("touch", 0, &conf);
+	conf.rightclick_enable = 1;
+	bench_touch ("touch+rightclick generic", 1, &conf);
+	bench_touch ("touch+rightclick", 0, &conf);
+	conf.rightclick_enable = 0;
+	conf.debounce_press = 30;
+	conf.debounce_release = 30;
+	bench_touch ("touch+debounce", 0, &conf);
+	conf.debounce_press = 0;
+	conf.debounce_release = 0;
+	conf.rightclick_enable = 1;
+	bench_io ("read/write", 0, &conf, &calibration);
+	bench_io ("io_uring", 1, &conf, &calibration);
+	bench_recorder ("flight recorder", &conf, &calibration);
+
+	transform_init (&transform, &conf, &calibration, PANEL_BITS_MIN);
+	if (ring_init (&transform) == 0) {
+		bench_ring_publish ("shm ring publish", &conf, &calibration);
+		bench_ring_latency ("shm ring latency", &conf, &calibration);
+	} else
+		printf ("%-28s not available\n", "shm ring");
+
+	return 0;
+}
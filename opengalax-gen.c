@@ -0,0 +1,302 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   opengalax-gen: synthetic PDU generator. Produces touch traces as the
+ *   panel would send them, optionally damaged (dropped bytes, line noise,
+ *   interleaved PS/2 mouse packets), to stress the frame decoder.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/select.h>
+
+#define PRESS 0x81
+#define RELEASE 0x80
+#define CMD_OK 0xFA
+
+
+#define die(str, args...) do { \
+	perror(str); \
+	exit(EXIT_FAILURE); \
+} while(0)
+
+static int fd_out = 1;
+static int fd_pty = -1;
+static int fd_slave = -1;
+
+static int rate = 100;		/* frames per second, 0 = as fast as possible */
+static int drop = 0;		/* % of frames losing one byte */
+static int noise = 0;		/* % of frames followed by garbage */
+static int mouse = 0;		/* % of frames followed by a PS/2 mouse packet */
+static const char *mix = "tdl";	/* t = tap, d = drag, l = long press */
+static int axis_max = 2047;	/* 11 bit coordinates */
+
+static long long frames = 0;
+static struct timespec next;
+
+static void usage (void) {
+	printf("opengalax-gen - synthetic PDU generator\n");
+	printf("Usage: opengalax-gen [options]\n");
+	printf("	-n <touches>         : number of touches, default=100, 0=endless\n");
+	printf("	-r <rate>            : frames per second, default=100, 0=no limit\n");
+	printf("	-t <mix>             : touch types, t=tap d=drag l=long press, default=tdl\n");
+	printf("	-d <percent>         : frames with a dropped byte\n");
+	printf("	-z <percent>         : frames followed by line noise\n");
+	printf("	-m <percent>         : frames followed by a PS/2 mouse packet\n");
+	printf("	-b <bits>            : coordinate resolution, 11, 12 or 14, default=11\n");
+	printf("	-s <seed>            : random seed\n");
+	printf("	-o <file>            : write to file instead of stdout\n");
+	printf("	-p                   : create a pty, acknowledge the panel init\n");
+	printf("	                       commands and write the trace to it\n");
+	exit (1);
+}
+
+/* answer every command byte sent by the daemon, like the panel does */
+static void ack_commands (void) {
+
+	unsigned char buf[64];
+	unsigned char ack[64];
+	ssize_t n;
+
+	if (fd_pty < 0)
+		return;
+
+	while ((n = read (fd_pty, buf, sizeof (buf))) > 0) {
+		memset (ack, CMD_OK, n);
+		if (write (fd_pty, ack, n) != n)
+			die ("error: write");
+	}
+}
+
+static void emit (const unsigned char *buf, int len) {
+
+	while (len > 0) {
+		ssize_t n = write (fd_out, buf, len);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			die ("error: write");
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void pace (void) {
+
+	ack_commands();
+
+	if (rate <= 0)
+		return;
+
+	next.tv_nsec += 1000000000L / rate;
+	while (next.tv_nsec >= 1000000000L) {
+		next.tv_nsec -= 1000000000L;
+		next.tv_sec++;
+	}
+	clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+}
+
+static int clamp (int v) {
+	return v < 0 ? 0 : v > axis_max ? axis_max : v;
+}
+
+static void frame (unsigned char click, int x, int y) {
+
+	unsigned char pdu[5];
+	unsigned char extra[8];
+	int i, len = 5;
+
+	x = clamp (x);
+	y = clamp (y);
+
+	pdu[0] = click;
+	pdu[1] = x >> 7;
+	pdu[2] = x & 0x7F;
+	pdu[3] = y >> 7;
+	pdu[4] = y & 0x7F;
+
+	if (drop && rand () % 100 < drop) {
+		i = rand () % 5;
+		memmove (pdu + i, pdu + i + 1, 4 - i);
+		len = 4;
+	}
+	emit (pdu, len);
+
+	if (noise && rand () % 100 < noise) {
+		len = 1 + rand () % sizeof (extra);
+		for (i = 0; i < len; i++)
+			extra[i] = rand ();
+		emit (extra, len);
+	}
+
+	// byte 0 of a PS/2 packet always has bit 3 set, deltas can look like headers
+	if (mouse && rand () % 100 < mouse) {
+		extra[0] = 0x08 | (rand () & 0x37);
+		extra[1] = rand ();
+		extra[2] = rand ();
+		emit (extra, 3);
+	}
+
+	frames++;
+	pace ();
+}
+
+/* a few counts of wobble, as a resting finger produces */
+static int jitter (void) {
+	return rand () % 5 - 2;
+}
+
+static void tap (void) {
+	int x = rand () % axis_max, y = rand () % axis_max;
+	int i, n = 3 + rand () % 4;
+
+	for (i = 0; i < n; i++)
+		frame (PRESS, x + jitter (), y + jitter ());
+	frame (RELEASE, x, y);
+}
+
+static void drag (void) {
+	int x0 = rand () % axis_max, y0 = rand () % axis_max;
+	int x1 = rand () % axis_max, y1 = rand () % axis_max;
+	int i, n = 30 + rand () % 70;
+
+	for (i = 0; i <= n; i++)
+		frame (PRESS, x0 + (x1 - x0) * i / n + jitter (), y0 + (y1 - y0) * i / n + jitter ());
+	frame (RELEASE, x1, y1);
+}
+
+static void long_press (void) {
+	int x = rand () % axis_max, y = rand () % axis_max;
+	int i, n = 100 + rand () % 100;
+
+	for (i = 0; i < n; i++)
+		frame (PRESS, x + jitter (), y + jitter ());
+	frame (RELEASE, x, y);
+}
+
+static void open_pty (void) {
+
+	struct termios tio;
+	int fd;
+
+	fd = posix_openpt (O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt (fd) < 0 || unlockpt (fd) < 0)
+		die ("error: pty");
+
+	// raw mode on the slave side, the daemon does not configure the line.
+	// the slave is kept open so the master does not see EIO between runs
+	fd_slave = open (ptsname (fd), O_RDWR | O_NOCTTY);
+	if (fd_slave < 0 || tcgetattr (fd_slave, &tio) < 0)
+		die ("error: pty");
+	cfmakeraw (&tio);
+	if (tcsetattr (fd_slave, TCSANOW, &tio) < 0)
+		die ("error: pty");
+
+	fcntl (fd, F_SETFL, O_NONBLOCK);
+	fd_pty = fd_out = fd;
+
+	fprintf (stderr, "pty: %s\n", ptsname (fd));
+}
+
+int main (int argc, char *argv[]) {
+
+	long long touches = 100, t;
+	unsigned int seed = time (NULL);
+	int opt, len;
+
+	while ((opt = getopt (argc, argv, "n:r:t:d:z:m:b:s:o:ph?")) != EOF) {
+		switch (opt) {
+			case 'n':
+				touches = atoll (optarg);
+				break;
+			case 'r':
+				rate = atoi (optarg);
+				break;
+			case 't':
+				mix = optarg;
+				break;
+			case 'd':
+				drop = atoi (optarg);
+				break;
+			case 'z':
+				noise = atoi (optarg);
+				break;
+			case 'm':
+				mouse = atoi (optarg);
+				break;
+			case 'b':
+				axis_max = (1 << atoi (optarg)) - 1;
+				break;
+			case 's':
+				seed = strtoul (optarg, NULL, 0);
+				break;
+			case 'o':
+				fd_out = open (optarg, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, 0644);
+				if (fd_out < 0)
+					die ("error: open");
+				break;
+			case 'p':
+				open_pty ();
+				break;
+			default:
+				usage ();
+				break;
+		}
+	}
+
+	len = strlen (mix);
+	if (len == 0)
+		usage ();
+
+	srand (seed);
+	clock_gettime (CLOCK_MONOTONIC, &next);
+
+	if (fd_pty >= 0) {
+		// give the daemon time to open the pty and initialize the panel
+		fprintf (stderr, "press enter to start\n");
+		while (1) {
+			fd_set fds;
+			FD_ZERO (&fds);
+			FD_SET (0, &fds);
+			FD_SET (fd_pty, &fds);
+			if (select (fd_pty + 1, &fds, NULL, NULL, NULL) < 0)
+				die ("error: select");
+			ack_commands ();
+			if (FD_ISSET (0, &fds) && getchar () == '\n')
+				break;
+		}
+		clock_gettime (CLOCK_MONOTONIC, &next);
+	}
+
+	for (t = 0; touches == 0 || t < touches; t++) {
+		switch (mix[rand () % len]) {
+			case 'd':
+				drag ();
+				break;
+			case 'l':
+				long_press ();
+				break;
+			default:
+				tap ();
+				break;
+		}
+	}
+
+	fprintf (stderr, "%lld touches, %lld frames, seed %u\n", t, frames, seed);
+	return 0;
+}
@@ -0,0 +1,414 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   opengalax-latency: closed loop latency measurement. Runs the daemon on
+ *   a pty standing in for the serial device, taps the panel through it and
+ *   times the button events on the evdev node the daemon creates.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+
+#define PRESS 0x81
+#define RELEASE 0x80
+#define CMD_OK 0xFA
+
+#define DEVICE_NAME "opengalax"
+#define STARTUP_TIMEOUT 10000	/* ms */
+#define SETTLE_TIME 500		/* ms, for the panel initialization */
+
+#define die(str, args...) do { \
+	perror(str); \
+	exit(EXIT_FAILURE); \
+} while(0)
+
+static const char *daemon_path = "opengalax";
+static const char *event_device = NULL;
+static const char *output = NULL;
+static int taps = 1000;
+static int period = 50;		/* ms between taps */
+static int hold = 10;		/* ms between press and release */
+
+static int fd_pty = -1;
+static int fd_slave = -1;
+static int fd_event = -1;
+static pid_t daemon_pid = -1;
+
+/* latencies in ns, to the input core (event timestamp) and to the reader */
+static long long *press_core, *press_read, *release_core, *release_read;
+static int presses, releases, lost;
+
+static void usage (void) {
+	printf("opengalax-latency - closed loop latency measurement\n");
+	printf("Usage: opengalax-latency [options]\n");
+	printf("	-d <daemon>          : daemon to run, default=opengalax\n");
+	printf("	-e <event-device>    : evdev node, default=the one the daemon creates\n");
+	printf("	-n <taps>            : number of taps, default=1000\n");
+	printf("	-p <ms>              : time between taps, default=50\n");
+	printf("	-t <ms>              : time between press and release, default=10\n");
+	printf("	-o <file>            : write every latency (ns) to file\n");
+	exit (1);
+}
+
+static long long now_ns (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* answer every command byte sent by the daemon, like the panel does */
+static void ack_commands (void) {
+
+	unsigned char buf[64];
+	unsigned char ack[64];
+	ssize_t n;
+
+	while ((n = read (fd_pty, buf, sizeof (buf))) > 0) {
+		memset (ack, CMD_OK, n);
+		if (write (fd_pty, ack, n) != n)
+			die ("error: write");
+	}
+}
+
+static void open_pty (void) {
+
+	struct termios tio;
+
+	fd_pty = posix_openpt (O_RDWR | O_NOCTTY);
+	if (fd_pty < 0 || grantpt (fd_pty) < 0 || unlockpt (fd_pty) < 0)
+		die ("error: pty");
+
+	// raw mode on the slave side, kept open so the master never sees EIO
+	fd_slave = open (ptsname (fd_pty), O_RDWR | O_NOCTTY);
+	if (fd_slave < 0 || tcgetattr (fd_slave, &tio) < 0)
+		die ("error: pty");
+	cfmakeraw (&tio);
+	if (tcsetattr (fd_slave, TCSANOW, &tio) < 0)
+		die ("error: pty");
+
+	fcntl (fd_pty, F_SETFL, O_NONBLOCK);
+}
+
+static void start_daemon (void) {
+
+	int fd;
+
+	daemon_pid = fork ();
+	if (daemon_pid < 0)
+		die ("error: fork");
+
+	if (daemon_pid == 0) {
+		fd = open ("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2 (fd, 1);
+			close (fd);
+		}
+		execlp (daemon_path, daemon_path, "-f", "-s", ptsname (fd_pty), (char *) NULL);
+		die ("error: exec");
+	}
+}
+
+static void stop_daemon (void) {
+	if (daemon_pid > 0) {
+		kill (daemon_pid, SIGTERM);
+		waitpid (daemon_pid, NULL, 0);
+		daemon_pid = -1;
+	}
+}
+
+/*
+ * Evdev nodes named like the daemon's device, as a bitmap of event numbers,
+ * so the one created by our daemon is the one that was not there before.
+ */
+#define EVENT_MAX 1024
+
+static void find_nodes (unsigned char *found) {
+
+	char path[300], name[256];
+	struct dirent *de;
+	DIR *dir;
+	int fd, n;
+
+	memset (found, 0, EVENT_MAX);
+
+	dir = opendir ("/dev/input");
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir (dir)) != NULL) {
+		if (sscanf (de->d_name, "event%d", &n) != 1 || n < 0 || n >= EVENT_MAX)
+			continue;
+		snprintf (path, sizeof (path), "/dev/input/%s", de->d_name);
+		fd = open (path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		if (ioctl (fd, EVIOCGNAME (sizeof (name)), name) >= 0 && strcmp (name, DEVICE_NAME) == 0)
+			found[n] = 1;
+		close (fd);
+	}
+	closedir (dir);
+}
+
+static void open_event_device (const char *path) {
+
+	int clock = CLOCK_MONOTONIC;
+
+	fd_event = open (path, O_RDONLY | O_NONBLOCK);
+	if (fd_event < 0)
+		die ("error: open event device");
+
+	// event timestamps on the same clock as ours
+	if (ioctl (fd_event, EVIOCSCLOCKID, &clock) < 0)
+		die ("error: EVIOCSCLOCKID");
+
+	fprintf (stderr, "event device: %s\n", path);
+}
+
+/* keep the pty going for ms, while the daemon starts or the panel settles */
+static void pump (int ms) {
+
+	struct pollfd pfd = { .fd = fd_pty, .events = POLLIN };
+	long long end = now_ns () + ms * 1000000LL;
+	int left;
+
+	while ((left = (end - now_ns ()) / 1000000) > 0) {
+		poll (&pfd, 1, left);
+		ack_commands ();
+	}
+}
+
+static void wait_for_device (void) {
+
+	unsigned char before[EVENT_MAX], after[EVENT_MAX];
+	char path[64];
+	long long end;
+	int n;
+
+	if (event_device != NULL) {
+		start_daemon ();
+		pump (SETTLE_TIME);
+		open_event_device (event_device);
+		return;
+	}
+
+	find_nodes (before);
+	start_daemon ();
+
+	end = now_ns () + STARTUP_TIMEOUT * 1000000LL;
+	while (now_ns () < end) {
+		pump (50);
+		find_nodes (after);
+		for (n = 0; n < EVENT_MAX; n++) {
+			if (after[n] && !before[n]) {
+				snprintf (path, sizeof (path), "/dev/input/event%d", n);
+				pump (SETTLE_TIME);
+				open_event_device (path);
+				return;
+			}
+		}
+		if (waitpid (daemon_pid, NULL, WNOHANG) == daemon_pid) {
+			daemon_pid = -1;
+			fprintf (stderr, "the daemon exited, is another instance running?\n");
+			exit (1);
+		}
+	}
+
+	stop_daemon ();
+	fprintf (stderr, "no %s event device showed up, is uinput loaded?\n", DEVICE_NAME);
+	exit (1);
+}
+
+static void frame (unsigned char click, int x, int y) {
+
+	unsigned char pdu[5];
+
+	pdu[0] = click;
+	pdu[1] = x >> 7;
+	pdu[2] = x & 0x7F;
+	pdu[3] = y >> 7;
+	pdu[4] = y & 0x7F;
+
+	if (write (fd_pty, pdu, sizeof (pdu)) != sizeof (pdu))
+		die ("error: write");
+}
+
+/*
+ * Waits up to ms for BTN_LEFT to become value, and records how long after
+ * sent it was reported. Returns 0 if it never came.
+ */
+static int wait_button (int value, long long sent, int ms, long long *core, long long *rd, int *count) {
+
+	struct pollfd pfd[2] = {
+		{ .fd = fd_event, .events = POLLIN },
+		{ .fd = fd_pty, .events = POLLIN },
+	};
+	struct input_event ev[64];
+	long long end = sent + ms * 1000000LL, t;
+	ssize_t n;
+	int i, left;
+
+	while ((left = (end - now_ns ()) / 1000000) >= 0) {
+
+		if (poll (pfd, 2, left) < 0 && errno != EINTR)
+			die ("error: poll");
+
+		ack_commands ();
+
+		n = read (fd_event, ev, sizeof (ev));
+		t = now_ns ();
+		if (n < 0 && errno != EAGAIN)
+			die ("error: read event device");
+
+		for (i = 0; i < n / (ssize_t) sizeof (ev[0]); i++) {
+			if (ev[i].type != EV_KEY || ev[i].code != BTN_LEFT || ev[i].value != value)
+				continue;
+			core[*count] = ev[i].input_event_sec * 1000000000LL + ev[i].input_event_usec * 1000LL - sent;
+			rd[*count] = t - sent;
+			(*count)++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int compare (const void *a, const void *b) {
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_stats (const char *name, long long *lat, int n) {
+
+	long long sum = 0;
+	int i;
+
+	if (n == 0) {
+		printf ("%-16s no samples\n", name);
+		return;
+	}
+
+	qsort (lat, n, sizeof (lat[0]), compare);
+	for (i = 0; i < n; i++)
+		sum += lat[i];
+
+	printf ("%-16s min %7.1f  p50 %7.1f  p90 %7.1f  p99 %7.1f  max %7.1f  mean %7.1f us\n", name,
+		lat[0] / 1000.0, lat[n / 2] / 1000.0, lat[n * 9 / 10] / 1000.0,
+		lat[n * 99 / 100] / 1000.0, lat[n - 1] / 1000.0, sum / 1000.0 / n);
+}
+
+static void write_output (void) {
+
+	FILE *fd;
+	int i;
+
+	if (output == NULL)
+		return;
+
+	fd = fopen (output, "w");
+	if (fd == NULL)
+		die ("error: open output");
+
+	fprintf (fd, "# event press_core press_read release_core release_read (ns)\n");
+	for (i = 0; i < presses || i < releases; i++)
+		fprintf (fd, "%d %lld %lld %lld %lld\n", i,
+			 i < presses ? press_core[i] : -1, i < presses ? press_read[i] : -1,
+			 i < releases ? release_core[i] : -1, i < releases ? release_read[i] : -1);
+	fclose (fd);
+}
+
+int main (int argc, char *argv[]) {
+
+	long long sent;
+	int opt, i, x, y;
+
+	while ((opt = getopt (argc, argv, "d:e:n:p:t:o:h?")) != EOF) {
+		switch (opt) {
+			case 'd':
+				daemon_path = optarg;
+				break;
+			case 'e':
+				event_device = optarg;
+				break;
+			case 'n':
+				taps = atoi (optarg);
+				break;
+			case 'p':
+				period = atoi (optarg);
+				break;
+			case 't':
+				hold = atoi (optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			default:
+				usage ();
+				break;
+		}
+	}
+
+	if (taps <= 0 || hold <= 0 || period <= hold)
+		usage ();
+
+	press_core = calloc (taps, sizeof (long long));
+	press_read = calloc (taps, sizeof (long long));
+	release_core = calloc (taps, sizeof (long long));
+	release_read = calloc (taps, sizeof (long long));
+	if (!press_core || !press_read || !release_core || !release_read)
+		die ("error: calloc");
+
+	open_pty ();
+	fprintf (stderr, "pty: %s\n", ptsname (fd_pty));
+	wait_for_device ();
+
+	for (i = 0; i < taps; i++) {
+
+		// wander around the middle of the panel, away from the edges
+		x = 512 + (i * 37) % 1024;
+		y = 512 + (i * 91) % 1024;
+
+		sent = now_ns ();
+		frame (PRESS, x, y);
+		if (!wait_button (1, sent, hold, press_core, press_read, &presses))
+			lost++;
+		pump ((sent + hold * 1000000LL - now_ns ()) / 1000000);
+
+		sent = now_ns ();
+		frame (RELEASE, x, y);
+		if (!wait_button (0, sent, period - hold, release_core, release_read, &releases))
+			lost++;
+		pump ((sent + (period - hold) * 1000000LL - now_ns ()) / 1000000);
+	}
+
+	stop_daemon ();
+
+	// before the statistics sort them
+	write_output ();
+
+	printf ("%d taps, %d events lost\n", taps, lost);
+	print_stats ("press core", press_core, presses);
+	print_stats ("press read", press_read, presses);
+	print_stats ("release core", release_core, releases);
+	print_stats ("release read", release_read, releases);
+
+	return 0;
+}
@@ -0,0 +1,393 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   opengalax-replay: reads the captures written by the daemon (capture=
+ *   in the config file). Prints them, or plays the panel traffic back to
+ *   stdout or to a pty with the original timing, from any point in time.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include "capture.h"
+
+#define CMD_OK 0xFA
+
+#define die(str, args...) do { \
+	perror(str); \
+	exit(EXIT_FAILURE); \
+} while(0)
+
+#define MODE_DUMP 0
+#define MODE_RAW 1
+#define MODE_INFO 2
+
+static const unsigned char *map;
+static size_t map_size;
+
+/* start time of every data block, from the index blocks */
+static int64_t *block_time;
+static uint64_t blocks;
+
+/* slot[s] is the last data block starting at or before second s */
+static uint64_t *slot;
+static uint64_t slots;
+
+static int fd_out = 1;
+static int fd_pty = -1;
+static int fd_slave = -1;
+static double speed = 1.0;
+
+static void usage (void) {
+	printf("opengalax-replay - plays back opengalax captures\n");
+	printf("Usage: opengalax-replay [options] <capture>\n");
+	printf("	-s <seconds>         : start this far into the capture\n");
+	printf("	-l <seconds>         : stop after this long\n");
+	printf("	-i                   : print information about the capture\n");
+	printf("	-r                   : write the panel bytes to stdout\n");
+	printf("	-p                   : create a pty, acknowledge the panel init\n");
+	printf("	                       commands and write the panel bytes to it\n");
+	printf("	-x <speed>           : playback speed, default=1, 0=no delays\n");
+	printf("	without -i, -r or -p the records are printed\n");
+	exit (1);
+}
+
+static const struct capture_block *data_block (uint64_t n) {
+
+	uint64_t off = capture_data_offset (n);
+	const struct capture_block *b;
+
+	if (off + sizeof (*b) > map_size)
+		return NULL;
+	b = (const struct capture_block *) (map + off);
+	if (b->magic != CAPTURE_DATA_MAGIC || off + sizeof (*b) + b->used > map_size)
+		return NULL;
+	return b;
+}
+
+/*
+ * The index blocks give the start time of the data blocks without touching
+ * them. After a crash the last group may not be indexed yet, its data
+ * block headers are read instead.
+ */
+static void load_index (void) {
+
+	const struct capture_index *idx = NULL;
+	const struct capture_block *b;
+	uint64_t group, n, alloc = 1024;
+	uint32_t i, count;
+	int64_t time_us;
+
+	block_time = malloc (alloc * sizeof (*block_time));
+	if (block_time == NULL)
+		die ("error: malloc");
+
+	for (group = 0; ; group++) {
+
+		count = 0;
+		if (capture_index_offset (group) + sizeof (*idx) <= map_size) {
+			idx = (const struct capture_index *) (map + capture_index_offset (group));
+			if (idx->magic == CAPTURE_INDEX_MAGIC && idx->count < CAPTURE_INDEX_EVERY)
+				count = idx->count;
+		}
+
+		for (i = 0; i < CAPTURE_INDEX_EVERY - 1; i++) {
+			n = group * (CAPTURE_INDEX_EVERY - 1) + i;
+			if (i < count)
+				time_us = idx->time_us[i];
+			else {
+				b = data_block (n);
+				if (b == NULL)
+					return;
+				time_us = b->time_us;
+			}
+			if (blocks == alloc) {
+				alloc *= 2;
+				block_time = realloc (block_time, alloc * sizeof (*block_time));
+				if (block_time == NULL)
+					die ("error: realloc");
+			}
+			block_time[blocks++] = time_us;
+		}
+	}
+}
+
+static void build_slots (void) {
+
+	uint64_t s, n = 0;
+
+	if (blocks == 0)
+		return;
+
+	slots = block_time[blocks - 1] / 1000000 + 1;
+	slot = malloc (slots * sizeof (*slot));
+	if (slot == NULL)
+		die ("error: malloc");
+
+	for (s = 0; s < slots; s++) {
+		while (n + 1 < blocks && block_time[n + 1] <= (int64_t) s * 1000000)
+			n++;
+		slot[s] = n;
+	}
+}
+
+/* the data block holding time us, in constant time */
+static uint64_t seek (int64_t us) {
+
+	uint64_t n;
+
+	if (us <= 0 || blocks == 0)
+		return 0;
+	if ((uint64_t) us / 1000000 >= slots)
+		return blocks - 1;
+
+	// only the blocks started within that second are scanned
+	n = slot[us / 1000000];
+	while (n + 1 < blocks && block_time[n + 1] <= us)
+		n++;
+	return n;
+}
+
+static void open_pty (void) {
+
+	struct termios tio;
+
+	fd_pty = posix_openpt (O_RDWR | O_NOCTTY);
+	if (fd_pty < 0 || grantpt (fd_pty) < 0 || unlockpt (fd_pty) < 0)
+		die ("error: pty");
+
+	fd_slave = open (ptsname (fd_pty), O_RDWR | O_NOCTTY);
+	if (fd_slave < 0 || tcgetattr (fd_slave, &tio) < 0)
+		die ("error: pty");
+	cfmakeraw (&tio);
+	if (tcsetattr (fd_slave, TCSANOW, &tio) < 0)
+		die ("error: pty");
+
+	fcntl (fd_pty, F_SETFL, O_NONBLOCK);
+	fd_out = fd_pty;
+
+	fprintf (stderr, "pty: %s\n", ptsname (fd_pty));
+}
+
+static void ack_commands (void) {
+
+	unsigned char buf[64];
+	unsigned char ack[64];
+	ssize_t n;
+
+	if (fd_pty < 0)
+		return;
+
+	while ((n = read (fd_pty, buf, sizeof (buf))) > 0) {
+		memset (ack, CMD_OK, n);
+		if (write (fd_pty, ack, n) != n)
+			die ("error: write");
+	}
+}
+
+static void wait_for_enter (void) {
+
+	fd_set fds;
+
+	fprintf (stderr, "press enter to start\n");
+	while (1) {
+		FD_ZERO (&fds);
+		FD_SET (0, &fds);
+		FD_SET (fd_pty, &fds);
+		if (select (fd_pty + 1, &fds, NULL, NULL, NULL) < 0)
+			die ("error: select");
+		ack_commands ();
+		if (FD_ISSET (0, &fds) && getchar () == '\n')
+			break;
+	}
+}
+
+static void emit (const unsigned char *buf, int len) {
+
+	while (len > 0) {
+		ssize_t n = write (fd_out, buf, len);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			die ("error: write");
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* sleep until capture time us, played from 'from' at clock 'base' */
+static void pace (int64_t us, int64_t from, struct timespec *base) {
+
+	struct timespec ts;
+	long long ns;
+
+	ack_commands ();
+
+	if (speed <= 0)
+		return;
+
+	ns = (us - from) * 1000 / speed;
+	ts.tv_sec = base->tv_sec + (base->tv_nsec + ns) / 1000000000LL;
+	ts.tv_nsec = (base->tv_nsec + ns) % 1000000000LL;
+	clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void play (int mode, int64_t from, int64_t to) {
+
+	const struct capture_block *b;
+	const unsigned char *p, *end, *raw;
+	struct timespec base;
+	uint64_t n, dt, len;
+	int64_t t, dx, dy, x, y;
+	int tag, i;
+
+	clock_gettime (CLOCK_MONOTONIC, &base);
+
+	for (n = seek (from); (b = data_block (n)) != NULL; n++) {
+
+		p = (const unsigned char *) (b + 1);
+		end = p + b->used;
+		t = b->time_us;
+		x = y = 0;
+
+		while (p < end) {
+			tag = *p++;
+			if ((p = capture_get_varint (p, end, &dt)) == NULL)
+				break;
+			t += dt;
+			if (to >= 0 && t > to)
+				return;
+
+			if ((tag & CAPTURE_TYPE) == CAPTURE_RAW) {
+				if ((p = capture_get_varint (p, end, &len)) == NULL || len > (uint64_t) (end - p))
+					break;
+				raw = p;
+				p += len;
+				if (t < from)
+					continue;
+				if (mode == MODE_RAW) {
+					pace (t, from, &base);
+					emit (raw, len);
+				} else {
+					printf ("%12.6f raw   ", t / 1e6);
+					for (i = 0; i < (int) len; i++)
+						printf (" %.2X", raw[i]);
+					printf ("\n");
+				}
+			} else {
+				if ((p = capture_get_zigzag (p, end, &dx)) == NULL ||
+				    (p = capture_get_zigzag (p, end, &dy)) == NULL)
+					break;
+				x += dx;
+				y += dy;
+				if (t < from || mode == MODE_RAW)
+					continue;
+				printf ("%12.6f sample x=%lld y=%lld %s%s\n", t / 1e6, (long long) x, (long long) y,
+					tag & CAPTURE_PRESSED ? "pressed" : "released",
+					tag & CAPTURE_INSIDE ? "" : " outside");
+			}
+		}
+	}
+}
+
+static void info (const struct capture_header *h) {
+
+	time_t start = h->start_realtime_us / 1000000;
+
+	printf ("started:  %s", ctime (&start));
+	printf ("duration: %.3f s or more\n", blocks ? block_time[blocks - 1] / 1e6 : 0.0);
+	printf ("blocks:   %llu of %u bytes\n", (unsigned long long) blocks, h->block_size);
+}
+
+int main (int argc, char *argv[]) {
+
+	const struct capture_header *header;
+	struct stat st;
+	double start = 0, length = -1;
+	int64_t from, to;
+	int opt, fd, mode = MODE_DUMP;
+
+	while ((opt = getopt (argc, argv, "s:l:irpx:h?")) != EOF) {
+		switch (opt) {
+			case 's':
+				start = atof (optarg);
+				break;
+			case 'l':
+				length = atof (optarg);
+				break;
+			case 'i':
+				mode = MODE_INFO;
+				break;
+			case 'r':
+				mode = MODE_RAW;
+				break;
+			case 'p':
+				mode = MODE_RAW;
+				open_pty ();
+				break;
+			case 'x':
+				speed = atof (optarg);
+				break;
+			default:
+				usage ();
+				break;
+		}
+	}
+
+	if (optind != argc - 1)
+		usage ();
+
+	fd = open (argv[optind], O_RDONLY);
+	if (fd < 0 || fstat (fd, &st) < 0)
+		die ("error: open");
+	map_size = st.st_size;
+	if (map_size < CAPTURE_HEADER_SIZE) {
+		fprintf (stderr, "%s: not a capture\n", argv[optind]);
+		exit (1);
+	}
+
+	map = mmap (NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		die ("error: mmap");
+
+	header = (const struct capture_header *) map;
+	if (memcmp (header->magic, CAPTURE_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->block_size != CAPTURE_BLOCK_SIZE || header->index_every != CAPTURE_INDEX_EVERY) {
+		fprintf (stderr, "%s: not a capture, or another version\n", argv[optind]);
+		exit (1);
+	}
+
+	load_index ();
+	build_slots ();
+
+	if (mode == MODE_INFO) {
+		info (header);
+		return 0;
+	}
+
+	if (fd_pty >= 0)
+		wait_for_enter ();
+
+	from = start * 1000000;
+	to = length < 0 ? -1 : from + length * 1000000;
+	play (mode, from, to);
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   opengalax-ring.h: interface for local clients reading the touch samples
+ *   straight from the daemon, without going through uinput and evdev.
+ *
+ */
+
+#ifndef OPENGALAX_RING_H
+#define OPENGALAX_RING_H
+
+#include <stdint.h>
+
+/*
+ * Clients connect to the control socket (SOCK_SEQPACKET) and send an
+ * OPENGALAX_MSG_SUBSCRIBE message. The answer carries two descriptors:
+ * the ring, to be mmap()ed read only, and an eventfd that becomes
+ * readable whenever new samples were published.
+ *
+ * With inject=1, an OPENGALAX_MSG_INJECT message followed by up to
+ * OPENGALAX_INJECT_MAX opengalax_touch records feeds synthetic touches to
+ * the daemon, which processes them like panel frames. The answer is sent
+ * once they are queued, with the number of records taken (0 if injection
+ * is disabled), so clients can wait for it to pace themselves. When the
+ * daemon's queue is full the records that do not fit are not taken, the
+ * client sends them again later.
+ *
+ * With live_direction=1, an OPENGALAX_MSG_DIRECTION message with the new
+ * direction (0-7, as direction= in the config file) in count and no
+ * records changes the orientation of the touches from the next frame on.
+ * The answer has count 1 if the direction was taken, 0 otherwise.
+ */
+#define OPENGALAX_SOCKET "/var/run/opengalax.sock"
+
+#define OPENGALAX_MSG_SUBSCRIBE	1
+#define OPENGALAX_MSG_INJECT	2
+#define OPENGALAX_MSG_DIRECTION	3
+
+struct opengalax_msg {
+	uint32_t type;
+	uint32_t count;		/* number of records following the header, or the direction */
+};
+
+#define OPENGALAX_INJECT_MAX	256
+
+struct opengalax_touch {
+	int32_t x;
+	int32_t y;
+	uint8_t pressed;
+	uint8_t raw;		/* panel coordinates, calibrated and oriented by the daemon */
+	uint8_t pad[2];
+};
+
+#define OPENGALAX_RING_MAGIC	0x4f47524eU	/* "OGRN" */
+#define OPENGALAX_RING_VERSION	1
+#define OPENGALAX_RING_SLOTS	1024		/* power of two */
+
+/* one decoded and transformed sample */
+struct opengalax_sample {
+	uint64_t seq;		/* index + 1 once written, 0 while being written */
+	int64_t time_ns;	/* CLOCK_MONOTONIC, when the frame was read */
+	int32_t x;		/* in the xmin..xmax, ymin..ymax range of the ring */
+	int32_t y;
+	uint8_t pressed;
+	uint8_t inside;		/* within the calibrated area */
+	uint8_t pad[6];
+};
+
+struct opengalax_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t sample_size;
+	int32_t xmin, xmax;
+	int32_t ymin, ymax;
+	/* number of samples published so far */
+	uint64_t head __attribute__ ((aligned (64)));
+	struct opengalax_sample sample[OPENGALAX_RING_SLOTS] __attribute__ ((aligned (64)));
+};
+
+/*
+ * There is a single writer and any number of readers, which never write
+ * to the ring. *next is the index of the next sample the reader expects,
+ * start with the current head. Returns 1 and the sample, 0 when there is
+ * nothing new, or -1 when the reader fell more than a ring behind: *next
+ * then skips to the oldest sample still available.
+ */
+static inline int opengalax_ring_read (const struct opengalax_ring *ring, uint64_t *next, struct opengalax_sample *s) {
+
+	uint64_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+	const struct opengalax_sample *slot;
+	uint64_t seq;
+
+	if (*next >= head)
+		return 0;
+
+	if (head - *next > OPENGALAX_RING_SLOTS) {
+		*next = head - OPENGALAX_RING_SLOTS;
+		return -1;
+	}
+
+	slot = &ring->sample[*next & (OPENGALAX_RING_SLOTS - 1)];
+	seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+	*s = *slot;
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	// overwritten while copying it
+	if (seq != *next + 1 || __atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq) {
+		head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+		*next = head > OPENGALAX_RING_SLOTS ? head - OPENGALAX_RING_SLOTS : 0;
+		return -1;
+	}
+
+	(*next)++;
+	return 1;
+}
+
+#endif
@@ -13,7 +13,11 @@
  *
  */
 
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include "opengalax.h"
+#include "opengalax-ring.h"
 
 #define VERSION "0.4"
 
@@ -21,78 +25,265 @@ void usage() {
 	printf("opengalax v%s - (c)2012 Pau Oliva Fora <pof@eslack.org>\n", VERSION);
 	printf("Usage: opengalax [options]\n");
 	printf("	-c                   : calibration mode\n");
+	printf("	-m <points>          : mesh calibration, points per side (%d to %d)\n", MESH_MIN, MESH_MAX);
 	printf("	-f                   : run in foreground (do not daemonize)\n");
 	printf("	-s <serial-device>   : default=/dev/serio_raw0\n");
 	printf("	-u <uinput-device>   : default=/dev/uinput\n");
+	printf("	-d <direction>       : change the direction of the running daemon\n");
 	exit (1);
 }
 
-int main (int argc, char *argv[]) {
+static conf_data conf;
+static touch_data touch;
+static queue_data queue;
+static int follow_x, follow_y;	/* uinput axes at the widest range */
+
+/*
+ * With threaded=1 the reader (main loop) only drains, decodes and
+ * transforms, and this thread runs the touch processing and uinput writes.
+ */
+static void *emitter (void *arg) {
+
+	struct timeval tv_current;
+	sample_data sample;
+	int timeout, pending;
+
+	(void) arg;
+
+	if (trace_enabled)
+		trace_thread(1, "emitter");
 
-	unsigned char click;
-	unsigned char xa, xb, ya, yb;
+	while (1) {
+
+		gettimeofday (&tv_current, NULL);
+		timeout = touch_poll(&touch, &tv_current);
+
+		if (!queue_wait(&queue, timeout < 0 ? TOUCH_IDLE : timeout)) {
+			// lift-off only while the reader waits with nothing left to read
+			pending = 0;
+			if (__atomic_load_n (&queue.reader_waiting, __ATOMIC_SEQ_CST) &&
+			    ioctl (fd_serial, FIONREAD, &pending) == 0 && pending == 0 &&
+			    queue_empty(&queue)) {
+				gettimeofday (&tv_current, NULL);
+				touch_timeout(&touch, &tv_current);
+			}
+			if (timeout < 0)
+				touch_idle(&touch);
+			continue;
+		}
 
-	int x, y;
-	int prev_x = 0;
-	int prev_y = 0;
+		while (queue_pop(&queue, &sample))
+			TRACE(TRACE_TOUCH, touch.sample(&touch, sample.click, sample.x, sample.y, sample.inside, &sample.tv));
+	}
 
-	int btn1_state = BTN1_RELEASE;
-	int btn2_state = BTN2_RELEASE;
+	return NULL;
+}
 
-	int old_btn1_state = BTN1_RELEASE;
-	int old_btn2_state = BTN2_RELEASE;
-	int first_click = 0;
+/* samples go straight to touch processing, or to the emitter thread */
+static void deliver_touch (sample_batch *batch, struct timeval *now) {
+
+	int i;
+
+	for (i = 0; i < batch->count; i++)
+		touch.sample(&touch, batch->click[i], batch->x[i], batch->y[i], batch->inside[i], now);
+}
+
+static void deliver_queue (sample_batch *batch, struct timeval *now) {
+
+	sample_data sample;
+	int i;
+
+	for (i = 0; i < batch->count; i++) {
+		sample.click = batch->click[i];
+		sample.inside = batch->inside[i];
+		sample.x = batch->x[i];
+		sample.y = batch->y[i];
+		sample.tv = *now;
+		queue_push(&queue, &sample);
+	}
+}
+
+/*
+ * With the resolution still to be detected, the uinput axes whose
+ * calibration values are at its full range get the widest range a
+ * controller can have. The device is created once, the panel values are
+ * scaled onto it as the resolution is found out.
+ */
+static void create_uinput (calibration_data *calibration, int bits) {
+
+	calibration_data range = *calibration;
+	conf_data device = conf;
+	int follow = conf.panel_bits == 0 && (conf.screen_width <= 0 || conf.screen_height <= 0);
+
+	follow_x = follow && calibration->xmax == AXIS_MAX(bits);
+	follow_y = follow && calibration->ymax == AXIS_MAX(bits);
+
+	if (follow_x) {
+		range.xmin = AXIS_SCALED(calibration->xmin, AXIS_SCALE(bits));
+		range.xmax = AXIS_MAX(PANEL_BITS_MAX);
+		device.fuzz_x = AXIS_SCALED(conf.fuzz_x, AXIS_SCALE(bits));
+		device.flat_x = AXIS_SCALED(conf.flat_x, AXIS_SCALE(bits));
+	}
+	if (follow_y) {
+		range.ymin = AXIS_SCALED(calibration->ymin, AXIS_SCALE(bits));
+		range.ymax = AXIS_MAX(PANEL_BITS_MAX);
+		device.fuzz_y = AXIS_SCALED(conf.fuzz_y, AXIS_SCALE(bits));
+		device.flat_y = AXIS_SCALED(conf.flat_y, AXIS_SCALE(bits));
+	}
+
+	setup_uinput_dev(conf.uinput_device, &device, &range);
+}
+
+/* scale the panel values of bits resolution onto the uinput axes */
+static void scale_uinput (int bits) {
+	touch_scale(&touch, follow_x ? AXIS_SCALE(bits) : AXIS_SCALE(PANEL_BITS_MAX),
+		    follow_y ? AXIS_SCALE(bits) : AXIS_SCALE(PANEL_BITS_MAX));
+}
+
+/*
+ * The controller sends more bits than assumed so far: calibration values
+ * still at the full range of the old resolution follow the new one.
+ */
+static void resolution_changed (calibration_data *calibration, transform_data *transform, int bits, int old_bits, int foreground) {
+
+	if (calibration->xmax == AXIS_MAX(old_bits))
+		calibration->xmax = AXIS_MAX(bits);
+	if (calibration->ymax == AXIS_MAX(old_bits))
+		calibration->ymax = AXIS_MAX(bits);
+
+	transform_init(transform, &conf, calibration, bits);
+	ring_range(transform);
+	scale_uinput(bits);
+
+	if (foreground)
+		printf("panel: %d bit coordinates\n", bits);
+}
+
+/* touches injected through the control socket go the way of panel frames */
+static void inject_touches (transform_data *transform, void (*deliver) (sample_batch *batch, struct timeval *now), int use_ring) {
+
+	sample_batch batch;
+	struct timeval now;
+	struct timespec ts;
+	int raw;
+
+	gettimeofday (&now, NULL);
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	while ((raw = control_inject(&batch)) >= 0) {
+		if (raw)
+			TRACE(TRACE_TRANSFORM, transform->batch(transform, &batch));
+		else
+			transform_clip(transform, &batch);
+		if (use_ring)
+			TRACE(TRACE_RING, ring_publish(&batch, &ts));
+		TRACE(TRACE_DELIVER, deliver(&batch, &now));
+	}
+
+	if (conf.threaded)
+		queue_notify(&queue);
+}
+
+static void print_stats (void) {
+	if (conf.threaded)
+		queue_stats(&queue);
+	touch_stats(&touch);
+	trace_dump();
+	capture_flush();
+	recorder_stats();
+	recorder_dump("SIGUSR2");
+}
+
+/* a termination signal came through the signalfd */
+static void terminate (int sig) {
+	control_cleanup();
+	trace_dump();
+	capture_flush();
+	signal_handler(sig);
+}
+
+int main (int argc, char *argv[]) {
+
+	unsigned char buf[BATCH_MAX * 5];
+	unsigned char *data = buf;
+
+	int pos;
+	int ret, timeout, next, sig;
+	int fd_signal;
+	int fd_control = -1;
+	int direction;
+	uint64_t wakeups;
+	int use_uring = 0;
+	int use_ring = 0;
+	int use_capture = 0;
+	int bits;
 
 	int foreground = 0;
 	int opt;
 
-	int calibration_mode=0;
-	int calib_xmin=X_AXIS_MAX;
-	int calib_xmax=0;
-	int calib_ymin=Y_AXIS_MAX;
-	int calib_ymax=0;
+	int calibration_mode=CALIBRATE_OFF;
+	int mesh_points=0;
 
 	pid_t pid;
 	ssize_t res;
 
-	struct input_event ev[2];
-	struct input_event ev_button[4];
-	struct input_event ev_sync;
-
-	struct timeval tv_start_click;
-	struct timeval tv_btn2_click;
 	struct timeval tv_current;
+	struct timeval tv_resume;
 	struct timeval tv;
+	struct timespec ts_start, ts_ready;
+	struct timespec ts_read;
 
-	conf_data conf;
 	calibration_data calibration;
+	calibration_data calibration_saved;
+	decoder_data decoder;
+	transform_data transform;
+	sample_batch batch;
+	pthread_t emitter_thread;
+	void (*deliver) (sample_batch *batch, struct timeval *now) = deliver_touch;
 
-	conf = config_parse();
-	calibration = calibration_parse();
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-	while ((opt = getopt(argc, argv, "chfs:u:?")) != EOF) {
+	config_load(&conf, &calibration);
+
+	while ((opt = getopt(argc, argv, "chfm:s:u:d:?")) != EOF) {
 		switch (opt) {
 			case 'h':
 				usage();
 				break;
 			case 'c':
-				calibration_mode=1;
+				calibration_mode=CALIBRATE_MINMAX;
+				break;
+			case 'm':
+				calibration_mode=CALIBRATE_MESH;
+				mesh_points=atoi(optarg);
+				if (mesh_points < MESH_MIN || mesh_points > MESH_MAX)
+					usage();
 				break;
 			case 'f':
 				foreground=1;
 				break;
 			case 's':
-				sprintf(conf.serial_device, "%s", optarg);
+				snprintf(conf.serial_device, sizeof(conf.serial_device), "%s", optarg);
 				break;
 			case 'u':
-				sprintf(conf.uinput_device, "%s", optarg);
+				snprintf(conf.uinput_device, sizeof(conf.uinput_device), "%s", optarg);
 				break;
+			case 'd':
+				ret = control_send_direction(atoi(optarg));
+				if (ret < 0)
+					fprintf(stderr, "cannot reach the daemon at %s: %s\n", OPENGALAX_SOCKET, strerror(errno));
+				else if (ret == 0)
+					fprintf(stderr, "direction not changed, check live_direction in /etc/opengalax.conf\n");
+				exit(ret == 1 ? 0 : 1);
 			default:
 				usage();
 				break;
 		}
 	}
 
+	// resolution of the controller, the decoder may find out it is higher
+	bits = conf.panel_bits ? conf.panel_bits : PANEL_BITS_MIN;
+
 	if (!running_as_root()) {
 		fprintf(stderr,"this program must be run as root user\n");
 		exit (-1);
@@ -100,10 +291,16 @@ int main (int argc, char *argv[]) {
 
 	if (calibration_mode) {
 		foreground=1;
+		// mesh calibration places its points with the configured values
+		calibration_saved=calibration;
 		calibration.xmin=0;
-		calibration.xmax=X_AXIS_MAX-1;
+		calibration.xmax=AXIS_MAX(bits);
 		calibration.ymin=0;
-		calibration.ymax=Y_AXIS_MAX-1;
+		calibration.ymax=AXIS_MAX(bits);
+		calibration.mesh_size=0;
+		// the values printed are panel values, not screen positions
+		conf.screen_width=0;
+		conf.screen_height=0;
 	}
 
 	printf("opengalax v%s ", VERSION);
@@ -138,12 +335,51 @@ int main (int argc, char *argv[]) {
 		printf ("\trightclick_duration=%d\n",conf.rightclick_duration);
 		printf ("\trightclick_range=%d\n",conf.rightclick_range);
 		printf ("\tdirection=%d\n",conf.direction);
+		printf ("\tlive_direction=%d\n",conf.live_direction);
+		printf ("\tscreen_width=%d\n",conf.screen_width);
+		printf ("\tscreen_height=%d\n",conf.screen_height);
+		printf ("\tmap_x=%d\n",conf.map_x);
+		printf ("\tmap_y=%d\n",conf.map_y);
+		printf ("\tmap_width=%d\n",conf.map_width);
+		printf ("\tmap_height=%d\n",conf.map_height);
 		printf ("\tpsmouse=%d\n",conf.psmouse);
+		printf ("\tedge_left=%d\n",conf.edge_left);
+		printf ("\tedge_right=%d\n",conf.edge_right);
+		printf ("\tedge_top=%d\n",conf.edge_top);
+		printf ("\tedge_bottom=%d\n",conf.edge_bottom);
+		printf ("\tjump_max=%d\n",conf.jump_max);
+		printf ("\tmin_press_duration=%d\n",conf.min_press_duration);
+		printf ("\tdebounce_press=%d\n",conf.debounce_press);
+		printf ("\tdebounce_release=%d\n",conf.debounce_release);
+		printf ("\tdebounce_range=%d\n",conf.debounce_range);
+		printf ("\ttouchdown_threshold=%d\n",conf.touchdown_threshold);
+		printf ("\ttouchdown_timeout=%d\n",conf.touchdown_timeout);
+		printf ("\tliftoff_factor=%d\n",conf.liftoff_factor);
+		printf ("\tliftoff_min=%d\n",conf.liftoff_min);
+		printf ("\tthreaded=%d\n",conf.threaded);
+		printf ("\tio_uring=%d\n",conf.io_uring);
+		printf ("\tfuzz_x=%d\n",conf.fuzz_x);
+		printf ("\tfuzz_y=%d\n",conf.fuzz_y);
+		printf ("\tflat_x=%d\n",conf.flat_x);
+		printf ("\tflat_y=%d\n",conf.flat_y);
+		printf ("\tresolution_x=%d\n",conf.resolution_x);
+		printf ("\tresolution_y=%d\n",conf.resolution_y);
+		printf ("\tsample_rate=%d\n",conf.sample_rate);
+		printf ("\tsample_resolution=%d\n",conf.sample_resolution);
+		printf ("\tidle_rate=%d\n",conf.idle_rate);
+		printf ("\tidle_timeout=%d\n",conf.idle_timeout);
+		printf ("\tpanel_bits=%d\n",conf.panel_bits);
+		printf ("\tshm_ring=%d\n",conf.shm_ring);
+		printf ("\tinject=%d\n",conf.inject);
+		printf ("\ttrace=%d\n",conf.trace);
+		printf ("\tcapture=%s\n",conf.capture);
+		printf ("\trecorder=%d\n",conf.recorder);
 		printf ("\nCalibration data:\n");
 		printf ("\txmin=%d\n",calibration.xmin);
 		printf ("\txmax=%d\n",calibration.xmax);
 		printf ("\tymin=%d\n",calibration.ymin);
-		printf ("\tymax=%d\n\n",calibration.ymax);
+		printf ("\tymax=%d\n",calibration.ymax);
+		printf ("\tmesh_size=%d\n\n",calibration.mesh_size);
 	}
 
 	// Open serial port
@@ -157,55 +393,94 @@ int main (int argc, char *argv[]) {
 	}
 
 	// configure uinput
-	setup_uinput_dev(conf.uinput_device);
+	create_uinput(&calibration, bits);
 
 	// handle signals
 	signal_installer();
+	fd_signal = signal_fd_setup();
+
+	// decoding, orientation and touch processing
+	decoder_init(&decoder, conf.panel_bits);
+	transform_init(&transform, &conf, &calibration, bits);
+	touch_init(&touch, &conf, foreground, calibration_mode);
+	scale_uinput(bits);
 
-	// input sync signal:
-	memset (&ev_sync, 0, sizeof (struct input_event));
-	ev_sync.type = EV_SYN;
-	ev_sync.code = 0;
-	ev_sync.value = 0;
-
-	// button press signals:
-	memset (&ev_button, 0, sizeof (ev_button));
-	ev_button[BTN1_RELEASE].type = EV_KEY;
-	ev_button[BTN1_RELEASE].code = BTN_LEFT;
-	ev_button[BTN1_RELEASE].value = 0;
-	ev_button[BTN1_PRESS].type = EV_KEY;
-	ev_button[BTN1_PRESS].code = BTN_LEFT;
-	ev_button[BTN1_PRESS].value = 1;
-	ev_button[BTN2_RELEASE].type = EV_KEY;
-	ev_button[BTN2_RELEASE].code = BTN_RIGHT;
-	ev_button[BTN2_RELEASE].value = 0;
-	ev_button[BTN2_PRESS].type = EV_KEY;
-	ev_button[BTN2_PRESS].code = BTN_RIGHT;
-	ev_button[BTN2_PRESS].value = 1;
+	// the flight recorder also sees the panel initialization
+	if (conf.recorder)
+		recorder_init();
 
 	// panel initialization
-	initialize_panel(0);
+	panel_setup(&conf);
+	initialize_panel();
 
 	if (foreground)
 		printf("pannel initialized\n");
 
-	if (calibration_mode) {
+	if (calibration_mode == CALIBRATE_MESH) {
+		printf("Touch each point asked for and hold the finger still until told the next one.\n\n");
+		mesh_init(&calibration_saved, conf.direction, bits, mesh_points);
+	} else if (calibration_mode) {
 		printf("Move the mouse around the screen to calibrate.\n");
+		printf("Hold a finger still for a few seconds to measure the fuzz.\n");
 		printf("When done click Ctrl+C to exit.\n");
-		printf("Remember to edit /etc/opengalax.conf and save your calibration values\n\n");
+		printf("Remember to edit /etc/opengalax.conf and save your calibration and fuzz values\n\n");
 	}
 
 	use_psmouse=0;
 	if (conf.psmouse) {
 		use_psmouse = 1;
 		uinput_open(conf.uinput_device);
+		uinput_create();
 
-		if (psmouse_connect() != 0) {
-			fprintf(stderr, "cannot connect to device\n");
-			return 1;
-		}
+		// the mouse is probed from the main loop, see psmouse_poll()
+		psmouse_connect();
+	}
 
-		uinput_create();
+	// samples also go to local clients through shared memory
+	if (conf.shm_ring) {
+		if (ring_init(&transform) == 0)
+			use_ring = 1;
+		else
+			fprintf(stderr, "cannot create the shared memory ring: %s\n", strerror(errno));
+	}
+
+	// the control socket serves the ring, takes injected touches and directions
+	if (use_ring || conf.inject || conf.live_direction) {
+		if (control_init(conf.inject, conf.live_direction, &fd_control) != 0)
+			fprintf(stderr, "cannot create %s: %s\n", OPENGALAX_SOCKET, strerror(errno));
+	}
+
+	// the emitter thread writes on its own, so io_uring only drives the
+	// single threaded loop
+	if (conf.io_uring && !conf.threaded) {
+		if (uring_init(fd_serial, fd_signal, fd_control) == 0) {
+			use_uring = 1;
+			uinput_write = uring_write;
+		} else if (foreground)
+			printf("io_uring not available, using read and write\n");
+	}
+
+	if (conf.capture[0] != '\0') {
+		if (capture_init(conf.capture) == 0)
+			use_capture = 1;
+		else
+			fprintf(stderr, "cannot create capture file %s: %s\n", conf.capture, strerror(errno));
+	}
+
+	// after the uinput writer is chosen, the writes are traced too
+	if (conf.trace)
+		trace_init();
+
+	clock_gettime(CLOCK_MONOTONIC, &ts_ready);
+	if (foreground)
+		printf("startup time: %ld ms\n",
+			(ts_ready.tv_sec - ts_start.tv_sec) * 1000 + (ts_ready.tv_nsec - ts_start.tv_nsec) / 1000000);
+
+	if (conf.threaded) {
+		deliver = deliver_queue;
+		queue_init(&queue);
+		if (pthread_create(&emitter_thread, NULL, emitter, NULL) != 0)
+			die ("error: pthread_create");
 	}
 
 	// main bucle
@@ -216,207 +491,148 @@ int main (int argc, char *argv[]) {
 		tv.tv_sec = 1;
 		tv.tv_usec = 0;
 
-		fd_set serial;
-		FD_ZERO (&serial);
-		FD_SET (fd_serial, &serial);
+		gettimeofday (&tv_current, NULL);
 
-		// Use select to use timeout...
-		if (select (fd_serial + 1, &serial, NULL, NULL, &tv) < 1) {
-			btn1_state = BTN1_RELEASE;
-			btn2_state = BTN2_RELEASE;
-			continue;
+		timeout = panel_init_poll(&tv_current);
+		next = panel_rate_poll(&tv_current);
+		if (next >= 0 && (timeout < 0 || next < timeout))
+			timeout = next;
+		if (use_psmouse) {
+			next = psmouse_poll(&tv_current);
+			if (next >= 0 && (timeout < 0 || next < timeout))
+				timeout = next;
 		}
-
-		// click must be 0x80 (release) or 0x81 (press)
-		do {
-
-			res = read (fd_serial, &click, sizeof (click));
-			if (click!=RELEASE && click!=PRESS) {
-				if (conf.psmouse) 
-					psmouse_interrupt(click);
-				else
-					printf ("ERROR: click=%.02X\n", click);
-			}
-		} while (click!=RELEASE && click!=PRESS);
-
-		res = read (fd_serial, &xa, sizeof (xa));
-		if (xa > XA_MAX) printf ("ERROR: xa=%.02X\n", xa);
-
-		res = read (fd_serial, &xb, sizeof (xb));
-		if (xb > XB_MAX) printf ("ERROR: xb=%.02X\n", xb);
-
-		res = read (fd_serial, &ya, sizeof (ya));
-		if (ya > YA_MAX) printf ("ERROR: ya=%.02X\n", ya);
-
-		res = read (fd_serial, &yb, sizeof (yb));
-		if (yb > YB_MAX) printf ("ERROR: yb=%.02X\n", yb);
-
-		if (res < 0)
-			die ("error reading from serial port");
-
-		if (DEBUG)
-			fprintf (stderr,"PDU: %.2X %.2X %.2X %.2X %.2X\n", click, xa, xb, ya, yb);
-
-		x = ((int)xa * XB_MAX) + ((int)xb);
-		y = Y_AXIS_MAX - ((int)ya * YB_MAX) + (YB_MAX - (int)yb);
-
-		switch (conf.direction) {
-			case 1:
-				x = X_AXIS_MAX - x;
-				break;
-			case 2:
-				y = Y_AXIS_MAX - y;
-				break;
-			case 3:
-				x = X_AXIS_MAX - ((int)xa * XB_MAX) + (XB_MAX - (int)xb);
-				y = ((int)ya * YB_MAX) + ((int)yb);
-				break;
-			case 4:
-				x = Y_AXIS_MAX - ((int)ya * YB_MAX) + (YB_MAX - (int)yb);
-				y = ((int)xa * XB_MAX) + ((int)xb);
-				break;
-			case 5:
-				x = ((int)ya * YB_MAX) + ((int)yb);
-				y = ((int)xa * XB_MAX) + ((int)xb);
-				break;
-			case 6:
-				x = Y_AXIS_MAX - ((int)ya * YB_MAX) + (YB_MAX - (int)yb);
-				y = X_AXIS_MAX - ((int)xa * XB_MAX) + (XB_MAX - (int)xb);
-				break;
-			case 7:
-				x = ((int)ya * YB_MAX) + ((int)yb);
-				y = X_AXIS_MAX - ((int)xa * XB_MAX) + (XB_MAX - (int)xb);
-
+		if (recorder_enabled) {
+			next = recorder_poll(&tv_current);
+			if (next >= 0 && (timeout < 0 || next < timeout))
+				timeout = next;
 		}
-
-		if (calibration_mode) {
-			// show calibration values
-			if (x > calib_xmax)
-				calib_xmax=x;
-			if (y > calib_ymax)
-				calib_ymax=y;
-			if (x < calib_xmin && x!=0)
-				calib_xmin=x;
-			if (y < calib_ymin && y!=0)
-				calib_ymin=y;
-			printf("     xmin=%d  xmax=%d  ymin=%d  ymax=%d          \r", calib_xmin, calib_xmax, calib_ymin, calib_ymax);
-			fflush(stdout);
-
-			continue;
+		if (!conf.threaded) {
+			next = touch_poll(&touch, &tv_current);
+			if (next >= 0 && (timeout < 0 || next < timeout))
+				timeout = next;
 		}
-
-		old_btn1_state = btn1_state;
-		old_btn2_state = btn2_state;
-
-		switch (click) {
-			case PRESS:
-				if (old_btn1_state == BTN1_RELEASE && old_btn2_state == BTN2_RELEASE) {
-					btn1_state = BTN1_PRESS;
-					btn2_state = BTN2_RELEASE;
-				}
-				break;
-			case RELEASE:
-				btn1_state = BTN1_RELEASE;
-				btn2_state = BTN2_RELEASE;
-				break;
+		if (timeout >= 0) {
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
 		}
 
-		// If this is the first panel event, track time for no-drag timer
-		first_click = 0;
-		if (old_btn1_state == BTN1_RELEASE && btn1_state == BTN1_PRESS)
-		{
-			first_click = 1;
-			gettimeofday (&tv_start_click, NULL);
-			gettimeofday (&tv_btn2_click, NULL);
+		if (use_uring) {
+			// the read, the signalfd read and the deadline are all queued
+			TRACE(TRACE_WAIT, res = uring_wait(&data, timeout < 0 ? TOUCH_IDLE : timeout, &sig));
+			ret = res;
+		} else {
+			fd_set serial;
+			FD_ZERO (&serial);
+			FD_SET (fd_serial, &serial);
+			FD_SET (fd_signal, &serial);
+			if (fd_control >= 0)
+				FD_SET (fd_control, &serial);
+
+			// Use select to use timeout...
+			next = fd_serial > fd_signal ? fd_serial : fd_signal;
+			__atomic_store_n (&queue.reader_waiting, 1, __ATOMIC_SEQ_CST);
+			TRACE(TRACE_WAIT, ret = select ((next > fd_control ? next : fd_control) + 1, &serial, NULL, NULL, &tv));
+			__atomic_store_n (&queue.reader_waiting, 0, __ATOMIC_SEQ_CST);
+
+			sig = 0;
+			if (ret > 0 && FD_ISSET (fd_signal, &serial))
+				sig = signal_fd_read(fd_signal);
+
+			if (ret > 0 && fd_control >= 0 && FD_ISSET (fd_control, &serial) &&
+			    read (fd_control, &wakeups, sizeof (wakeups)) < 0 && errno != EAGAIN)
+				die ("error: eventfd");
+
+			res = -1;
+			if (ret > 0 && FD_ISSET (fd_serial, &serial)) {
+				data = buf;
+				TRACE(TRACE_READ, res = read (fd_serial, buf, sizeof (buf)));
+				if (res < 0)
+					die ("error reading from serial port");
+			}
 		}
 
-		// load X,Y into input_events
-		memset (ev, 0, sizeof (ev));
-		ev[0].type = EV_ABS;
-		ev[0].code = ABS_X;
-		ev[0].value = x;
-		ev[1].type = EV_ABS;
-		ev[1].code = ABS_Y;
-		ev[1].value = y;
-
-		gettimeofday (&tv_current, NULL);
+		if (sig == SIGINT || sig == SIGTERM || sig == SIGHUP || sig == SIGQUIT)
+			terminate(sig);
+
+		if (sig == SIGUSR2)
+			print_stats();
+
+		// on resume drop stale bytes and reinitialize the panel in the background
+		if (system_resumed() || sig == SIGUSR1) {
+			gettimeofday (&tv_resume, NULL);
+			if (use_uring)
+				uring_flush();
+			else
+				flush_serial_port();
+			decoder_reset(&decoder);
+			panel_init_start();
+			touch_resume(&touch, &tv_resume);
+			if (foreground)
+				printf("resume: reinitializing panel\n");
+			continue;
+		}
 
-		// Only move to posision of click for first while - prevents accidental dragging.
-		if (time_elapsed_ms (&tv_start_click, &tv_current, 200) || first_click)
-		{
-			// send X,Y
-			if (write (fd_uinput, &ev[0], sizeof (struct input_event)) < 0)
-				die ("error: write");
-			if (write (fd_uinput, &ev[1], sizeof (struct input_event)) < 0)
-				die ("error: write");
-		} else {
-			// store position for right click management
-			prev_x = x;
-			prev_y = y;
+		// a new direction applies from the next batch on, never within one
+		if (fd_control >= 0 && (direction = control_direction()) >= 0) {
+			conf.direction = direction;
+			transform_direction(&transform, direction, bits);
+			if (foreground)
+				printf("direction: %d\n", direction);
 		}
 
-		if (conf.rightclick_enable) {
+		// eventfds of ring clients that left are closed here, touches or not
+		if (use_ring)
+			ring_reap();
 
-			// emulate right click by press and hold
-			if (time_elapsed_ms (&tv_btn2_click, &tv_current, conf.rightclick_duration)) {
-				if ( ( x-(conf.rightclick_range/2) < prev_x && prev_x < x+(conf.rightclick_range/2) ) && 
-				     ( y-(conf.rightclick_range/2) < prev_y && prev_y < y+(conf.rightclick_range/2) ) ) {
-					btn2_state=BTN2_PRESS;
-					btn1_state=BTN1_RELEASE;
-				}
-			}
+		if (fd_control >= 0 && conf.inject)
+			TRACE(TRACE_INJECT, inject_touches(&transform, deliver, use_ring));
 
-			// reset the start click counter and store position (allows select text + rightclick)
-			if (time_elapsed_ms (&tv_btn2_click, &tv_current, conf.rightclick_duration*2) && btn2_state == BTN2_RELEASE) {
-				gettimeofday (&tv_btn2_click, NULL);
-				prev_x = x;
-				prev_y = y;
+		if (ret < 1 || res < 0) {
+			if (ret == 0 && !conf.threaded) {
+				gettimeofday (&tv_current, NULL);
+				touch_timeout(&touch, &tv_current);
 			}
+			if (ret == 0 && timeout < 0 && !conf.threaded)
+				touch_idle(&touch);
+			continue;
+		}
 
-			// force button2 transition
-			if (old_btn2_state == BTN2_RELEASE && btn2_state == BTN2_PRESS)
-			{
-				if (write(fd_uinput, &ev_button[BTN1_RELEASE], sizeof (struct input_event)) < 0)
-					die ("error: write");
-				if (write(fd_uinput, &ev_button[BTN2_RELEASE], sizeof (struct input_event)) < 0)
-					die ("error: write");
-				if (write (fd_uinput, &ev_sync, sizeof (struct input_event)) < 0)
-					die ("error: write");
-				if (foreground)
-					printf ("X: %d Y: %d BTN1: OFF BTN2: OFF FIRST: %s\n", x, y,
-					first_click == 0 ? "No" : first_click == 1 ? "Yes" : "Unknown");
-
-				usleep (10000);
-
-				if (write(fd_uinput, &ev_button[BTN1_RELEASE], sizeof (struct input_event)) < 0)
-					die ("error: write");
-				if (write(fd_uinput, &ev_button[BTN2_PRESS], sizeof (struct input_event)) < 0)
-					die ("error: write");
-				if (write (fd_uinput, &ev_sync, sizeof (struct input_event)) < 0)
-					die ("error: write");
-				if (foreground)
-					printf ("X: %d Y: %d BTN1: OFF BTN2: ON  FIRST: %s\n", x, y,
-					first_click == 0 ? "No" : first_click == 1 ? "Yes" : "Unknown");
+		gettimeofday (&tv_current, NULL);
+		if (use_ring || use_capture || recorder_enabled)
+			clock_gettime(CLOCK_MONOTONIC, &ts_read);
+		if (use_capture)
+			capture_raw(data, res, &ts_read);
+		if (recorder_enabled)
+			recorder_raw(data, res, &ts_read);
+
+		// decode every PDU read at once, then transform them as a batch
+		for (pos = 0; pos < res; ) {
+
+			batch.count = 0;
+			TRACE(TRACE_DECODE, pos += decode_bytes(&decoder, data + pos, res - pos, &batch));
+			if (decoder.bits != bits) {
+				resolution_changed(&calibration, &transform, decoder.bits, bits, foreground);
+				bits = decoder.bits;
 			}
-
-			// clicking button2
-			if (write(fd_uinput, &ev_button[btn2_state], sizeof (struct input_event)) < 0)
-				die ("error: write");
+			TRACE(TRACE_TRANSFORM, transform.batch(&transform, &batch));
+			if (use_capture)
+				capture_samples(&batch);
+			if (recorder_enabled)
+				recorder_samples(&batch, &ts_read);
+			if (use_ring)
+				TRACE(TRACE_RING, ring_publish(&batch, &ts_read));
+			TRACE(TRACE_DELIVER, deliver(&batch, &tv_current));
+			if (batch.count)
+				panel_rate_frame(&tv_current);
 		}
 
-		// clicking button1
-		if (write(fd_uinput, &ev_button[btn1_state], sizeof (struct input_event)) < 0)
-			die ("error: write");
-
-		// Sync
-		if (write (fd_uinput, &ev_sync, sizeof (struct input_event)) < 0)
-			die ("error: write");
+		// one report for the PS/2 mouse packets of this read
+		if (use_psmouse)
+			TRACE(TRACE_PSMOUSE, psmouse_flush());
 
-		if (foreground)
-			printf ("X: %d Y: %d BTN1: %s BTN2: %s FIRST: %s\n", x, y,
-				btn1_state == BTN1_RELEASE ? "OFF" : btn1_state == BTN1_PRESS ? "ON " : "Unknown",
-				btn2_state == BTN2_RELEASE ? "OFF" : btn2_state == BTN2_PRESS ? "ON " : "Unknown",
-				first_click == 0 ? "No" : first_click == 1 ? "Yes" : "Unknown");
+		if (conf.threaded)
+			queue_notify(&queue);
 	}
 
 	return 0;
@@ -17,15 +17,23 @@
 #include <signal.h>
 #include <linux/uinput.h>
 #include <sys/stat.h>
-
-#define XA_MAX 0xF
-#define YA_MAX 0xF
+#include <sys/time.h>
+#include <time.h>
 
 #define XB_MAX	0x7F
 #define YB_MAX	0x7F
 
-#define X_AXIS_MAX (XA_MAX+1)*(XB_MAX+1)
-#define Y_AXIS_MAX (YA_MAX+1)*(YB_MAX+1)
+/*
+ * Coordinates are sent as a high byte and 7 low bits. 11 bit controllers
+ * use 4 bits of the high byte, 12 and 14 bit ones use 5 and 7.
+ */
+#define PANEL_BITS_MIN 11
+#define PANEL_BITS_MAX 14
+#define AXIS_MAX(bits) ((1 << (bits)) - 1)
+#define XA_MAX(bits) (AXIS_MAX(bits) >> 7)
+/* 16.16 factor from a bits resolution to the widest one, and its use */
+#define AXIS_SCALE(bits) ((int) (((long long) AXIS_MAX(PANEL_BITS_MAX) << 16) / AXIS_MAX(bits)))
+#define AXIS_SCALED(v, scale) ((int) (((long long) (v) * (scale) + (1 << 15)) >> 16))
 
 #define CMD_OK 0xFA
 #define CMD_ERR 0xFE
@@ -54,47 +62,419 @@ typedef struct {
 	int rightclick_range;
 	int direction;
 	int psmouse;
+	int edge_left;
+	int edge_right;
+	int edge_top;
+	int edge_bottom;
+	int jump_max;
+	int min_press_duration;
+	int touchdown_threshold;
+	int touchdown_timeout;
+	int liftoff_factor;
+	int liftoff_min;
+	int threaded;
+	int io_uring;
+	int fuzz_x;
+	int fuzz_y;
+	int flat_x;
+	int flat_y;
+	int resolution_x;
+	int resolution_y;
+	int sample_rate;
+	int sample_resolution;
+	int idle_rate;
+	int idle_timeout;
+	int panel_bits;
+	int shm_ring;
+	int inject;
+	int trace;
+	char capture[1024];
+	int recorder;
+	int live_direction;
+	int screen_width;
+	int screen_height;
+	int map_x;
+	int map_y;
+	int map_width;
+	int map_height;
+	int debounce_press;
+	int debounce_release;
+	int debounce_range;
 } conf_data;
 
+/* nonlinearity correction mesh, points per side */
+#define MESH_MIN 3
+#define MESH_MAX 17
+
 typedef struct {
 	int xmin;
 	int xmax;
 	int ymin;
 	int ymax;
+	int mesh_size;			/* 0 = no mesh */
+	/* correction added to the panel values, in panel order: [v][u][du, dv] */
+	short mesh[MESH_MAX][MESH_MAX][2];
 } calibration_data;
 
-int fd_serial, fd_uinput;
-struct uinput_user_dev uidev;
-int use_psmouse;
+/* frame decoder state */
+typedef struct {
+	unsigned char pdu[5];
+	int count;
+	int bits;		/* coordinate resolution */
+	int detect;		/* bits is inferred from the frames */
+} decoder_data;
+
+/* coalesced samples, structure of arrays */
+#define BATCH_MAX 64
+
+typedef struct {
+	unsigned char click[BATCH_MAX];
+	unsigned char xa[BATCH_MAX];
+	unsigned char xb[BATCH_MAX];
+	unsigned char ya[BATCH_MAX];
+	unsigned char yb[BATCH_MAX];
+	int x[BATCH_MAX];
+	int y[BATCH_MAX];
+	unsigned char inside[BATCH_MAX];
+	int count;
+} sample_batch;
+
+/*
+ * fixed point (16.16) affine transform: x = (cx + xu*u + xv*v) >> 16, with
+ * a smaller shift when a large output mapping would overflow 32 bits
+ */
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1 << FIXED_SHIFT)
+
+typedef struct transform_data {
+	int cx, xu, xv;
+	int cy, yu, yv;
+	int shift;
+	int xmin, xmax, ymin, ymax;
+	int edge_xmin, edge_xmax, edge_ymin, edge_ymax;
+	/* output mapping, screen = offset + calibrated * scale, in 16.16 */
+	int scale_x, scale_y;
+	long long offset_x, offset_y;
+	/* axis ranges of the output, as the uinput device has them */
+	int range_xmin, range_xmax, range_ymin, range_ymax;
+	/* nonlinearity correction of the panel values, see transform_mesh() */
+	int mesh;
+	int mesh_shift;
+	int mesh_max;
+	/* transform_batch() or the variant specialized for the coefficients */
+	void (*batch) (const struct transform_data *tr, sample_batch *batch);
+} transform_data;
+
+/* palm and edge rejection state */
+typedef struct {
+	int jump_max;
+	int min_press_duration;
+	int last_x;
+	int last_y;
+	int jumps;
+	int pressed;
+	int confirmed;
+	struct timeval tv_press;
+} reject_data;
+
+/* touch-down stabilizer state */
+typedef struct {
+	int threshold;
+	int timeout;
+	int locked;
+	int anchor_x;
+	int anchor_y;
+	struct timeval tv_down;
+} hysteresis_data;
+
+/* what debounce_sample() wants done with a sample */
+#define DEBOUNCE_PASS 0
+#define DEBOUNCE_DROP 1
+#define DEBOUNCE_FLUSH 2	/* report the held release first, then the sample */
+
+/* press/release chatter suppression state */
+typedef struct {
+	int press_min;
+	int release_min;
+	int range;
+	int short_max;		/* ms, releases of shorter presses are held */
+	int down;		/* a press went through */
+	int held;		/* its release is held back */
+	int confirming;		/* a press near the last release is held back */
+	int release_x;
+	int release_y;
+	struct timeval tv_press;
+	struct timeval tv_release;
+	struct timeval tv_confirm;
+	unsigned int presses;	/* suppressed transitions */
+	unsigned int releases;
+} debounce_data;
+
+/* lift-off detector state */
+typedef struct {
+	int factor;
+	int min;
+	int interval;		/* measured report interval, us */
+	int armed;
+	struct timeval tv_last;
+} liftoff_data;
+
+/* largest distance between two samples still taken as noise */
+#define NOISE_MAX 16
+
+/* calibration modes: min/max and fuzz (-c), nonlinearity mesh (-m) */
+#define CALIBRATE_OFF 0
+#define CALIBRATE_MINMAX 1
+#define CALIBRATE_MESH 2
+
+/* touch processing state, from decoded samples to uinput events */
+typedef struct touch_data {
+	conf_data *conf;
+	int foreground;
+	int calibration_mode;		/* CALIBRATE_* */
+	int calib_xmin;
+	int calib_xmax;
+	int calib_ymin;
+	int calib_ymax;
+	int calib_pressed;
+	int calib_last_x;
+	int calib_last_y;
+	unsigned int noise_x[NOISE_MAX];	/* distance histograms, calibration mode */
+	unsigned int noise_y[NOISE_MAX];
+	int btn1_state;
+	int btn2_state;
+	int prev_x;
+	int prev_y;
+	struct timeval tv_btn2_click;
+	int rightclick_pending;
+	int rightclick_x;
+	int rightclick_y;
+	struct timeval tv_rightclick;
+	int resume_pending;
+	struct timeval tv_resume;
+	reject_data rejection;
+	hysteresis_data hysteresis;
+	debounce_data debounce;
+	liftoff_data liftoff;
+	int scale_x;			/* uinput values per panel value, AXIS_SCALE() */
+	int scale_y;
+	struct input_event out[8];	/* events of the report being built */
+	int out_count;
+	/* touch_sample() or the variant specialized for the configuration */
+	void (*sample) (struct touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now);
+} touch_data;
+
+/* idle time after which the button state is forgotten */
+#define TOUCH_IDLE 1000	/* ms */
+
+/* single producer, single consumer queue between reader and emitter */
+#define QUEUE_SIZE 256
+
+typedef struct {
+	unsigned char click;
+	unsigned char inside;
+	int x;
+	int y;
+	struct timeval tv;
+} sample_data;
+
+typedef struct {
+	sample_data ring[QUEUE_SIZE];
+	/* producer side */
+	unsigned int head __attribute__ ((aligned (64)));
+	unsigned char last_click;
+	unsigned char edge[QUEUE_SIZE];	/* the slot holds a button edge */
+	int reader_waiting;		/* the reader is in its wait for the panel */
+	unsigned long pushed;
+	unsigned long dropped;
+	unsigned int max_depth;
+	/* consumer side */
+	unsigned int tail __attribute__ ((aligned (64)));
+	unsigned char last_popped;
+	unsigned long coalesced;
+	int fd_event;
+} queue_data;
+
+extern int fd_serial, fd_uinput;
+extern struct uinput_user_dev uidev;
+extern int use_psmouse;
+extern void (*uinput_write) (int fd, const struct input_event *ev, int count);
 
 /* configfile.c */
-int create_config_file (char* file);
-conf_data config_parse (void);
-calibration_data calibration_parse (void);
+int create_config_file (const char* file);
+void config_load (conf_data *config, calibration_data *calibration);
+int config_save_mesh (calibration_data *calibration);
 
 /* functions.c */
 int running_as_root (void);
 int time_elapsed_ms (struct timeval *start, struct timeval *end, int ms); 
-int configure_uinput (void);
-int setup_uinput (void);
-int setup_uinput_dev (const char *ui_dev);
+int configure_uinput (conf_data *conf, calibration_data *calibration);
+int setup_uinput_dev (const char *ui_dev, conf_data *conf, calibration_data *calibration);
 int open_serial_port (const char *fd_device); 
-int init_panel (); 
-void initialize_panel (int sig);
+int init_panel (void);
+void initialize_panel (void);
+void panel_init_start (void);
+int panel_init_active (void);
+int panel_init_byte (unsigned char data);
+int panel_init_poll (struct timeval *now);
+void panel_setup (conf_data *conf);
+void panel_rate_frame (struct timeval *now);
+int panel_rate_poll (struct timeval *now);
+void flush_serial_port (void);
+int system_resumed (void);
+int signal_fd_setup (void);
+int signal_fd_read (int fd);
 void signal_handler (int sig);
 void signal_installer (void);
-int file_exists (char *file);
-char* default_pid_file (void); 
-int create_pid_file (void); 
+int file_exists (const char *file);
+int create_pid_file (void);
 int remove_pid_file (void);
+void write_events (int fd, const struct input_event *ev, int count);
+
+/* filter.c */
+void reject_init (reject_data *rej, conf_data *conf);
+void reject_reset (reject_data *rej);
+int reject_sample (reject_data *rej, unsigned char click, int x, int y, int inside, struct timeval *now);
+void hysteresis_init (hysteresis_data *hys, conf_data *conf);
+int hysteresis_sample (hysteresis_data *hys, int first_click, int x, int y, struct timeval *now);
+void debounce_init (debounce_data *db, conf_data *conf);
+void debounce_reset (debounce_data *db);
+int debounce_sample (debounce_data *db, unsigned char click, int x, int y, struct timeval *now);
+int debounce_poll (debounce_data *db, struct timeval *now);
+void liftoff_init (liftoff_data *lo, conf_data *conf);
+void liftoff_frame (liftoff_data *lo, unsigned char click, struct timeval *now);
+void liftoff_arm (liftoff_data *lo, int pressed);
+int liftoff_poll (liftoff_data *lo, struct timeval *now);
+
+/* touch.c */
+void touch_init (touch_data *t, conf_data *conf, int foreground, int calibration_mode);
+void touch_resume (touch_data *t, struct timeval *now);
+void touch_scale (touch_data *t, int scale_x, int scale_y);
+int touch_poll (touch_data *t, struct timeval *now);
+void touch_timeout (touch_data *t, struct timeval *now);
+void touch_idle (touch_data *t);
+void touch_sample (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now);
+void touch_stats (touch_data *t);
+
+/* mesh.c */
+void mesh_init (calibration_data *calibration, int direction, int bits, int points);
+void mesh_sample (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now);
+
+/* queue.c */
+void queue_init (queue_data *q);
+int queue_push (queue_data *q, const sample_data *s);
+void queue_notify (queue_data *q);
+int queue_wait (queue_data *q, int timeout);
+int queue_empty (queue_data *q);
+int queue_pop (queue_data *q, sample_data *s);
+void queue_stats (queue_data *q);
+
+/* decoder.c */
+void decoder_init (decoder_data *dec, int bits);
+void decoder_reset (decoder_data *dec);
+int decode_bytes (decoder_data *dec, const unsigned char *buf, int len, sample_batch *batch);
+
+/* transform.c */
+void transform_init (transform_data *tr, conf_data *conf, calibration_data *calibration, int bits);
+void transform_direction (transform_data *tr, int direction, int bits);
+void transform_range (conf_data *conf, calibration_data *calibration, int *xmin, int *xmax, int *ymin, int *ymax);
+void transform_raw (int direction, int bits, int x, int y, int *u, int *v);
+void transform_raw_box (calibration_data *calibration, int direction, int bits, int *u0, int *u1, int *v0, int *v1);
+void transform_batch (const transform_data *tr, sample_batch *batch);
+void transform_clip (const transform_data *tr, sample_batch *batch);
+
+/* uring.c */
+int uring_init (int fd, int fd_signal, int fd_wake);
+void uring_write (int fd, const struct input_event *ev, int count);
+int uring_wait (unsigned char **data, int timeout, int *sig);
+void uring_flush (void);
+
+/* ring.c */
+int ring_init (transform_data *tr);
+void ring_range (transform_data *tr);
+void ring_reap (void);
+void ring_publish (const sample_batch *batch, struct timespec *now);
+int ring_subscribe (int *fd_map, int *fd_event);
+void ring_unsubscribe (int client);
+
+/* control.c */
+int control_init (int inject, int direction, int *fd_control);
+int control_direction (void);
+int control_inject (sample_batch *batch);
+void control_cleanup (void);
+int control_send_direction (int direction);
+
+/* trace.c */
+#define TRACE_WAIT	0
+#define TRACE_READ	1
+#define TRACE_DECODE	2
+#define TRACE_TRANSFORM	3
+#define TRACE_RING	4
+#define TRACE_DELIVER	5
+#define TRACE_TOUCH	6
+#define TRACE_WRITE	7
+#define TRACE_PSMOUSE	8
+#define TRACE_INJECT	9
+#define TRACE_STAGES	10
+
+extern int trace_enabled;
+
+/* runs stmt, timing it as stage when tracing */
+#define TRACE(stage, stmt) do { \
+	if (__builtin_expect (trace_enabled, 0)) { \
+		long long trace_t0 = trace_clock (); \
+		stmt; \
+		trace_record (stage, trace_t0); \
+	} else { \
+		stmt; \
+	} \
+} while (0)
+
+long long trace_clock (void);
+void trace_record (int stage, long long t0);
+void trace_thread (int id, const char *name);
+void trace_init (void);
+void trace_dump (void);
+
+/* capture.c */
+typedef struct capture_file capture_file;
+
+capture_file *capture_open (const char *path, long long start_ns);
+void capture_write_raw (capture_file *c, long long ns, const unsigned char *data, int len);
+void capture_write_sample (capture_file *c, long long ns, int x, int y, int click, int inside);
+void capture_sync (capture_file *c);
+void capture_close (capture_file *c);
+int capture_init (const char *path);
+void capture_raw (const unsigned char *data, int len, struct timespec *now);
+void capture_samples (const sample_batch *batch);
+void capture_flush (void);
+
+/* recorder.c */
+#define RECORDER_CLICK		0
+#define RECORDER_PDU		1
+#define RECORDER_PSMOUSE_SYNC	2
+#define RECORDER_INIT		3
+#define RECORDER_ANOMALIES	4
+
+extern int recorder_enabled;
+
+void recorder_init (void);
+void recorder_raw (const unsigned char *data, int len, struct timespec *now);
+void recorder_samples (const sample_batch *batch, struct timespec *now);
+void recorder_anomaly (int anomaly);
+void recorder_dump (const char *why);
+int recorder_poll (struct timeval *now);
+void recorder_stats (void);
 
 /* psmouse.c */
 
 void uinput_open(const char *uinput_dev_name); 
 int psmouse_connect();
 void uinput_create(); 
-int phys_wait_for_input(int *ptimeout); 
+int psmouse_poll(struct timeval *now);
+int psmouse_busy();
 void psmouse_interrupt(unsigned char data);
+void psmouse_flush();
 void uinput_destroy();
 void uinput_close();
 void psmouse_disconnect();
@@ -119,13 +499,15 @@ byte 0:
 	0x81 == RELEASE
 
 byte 1:
-	X axis value, from 0 to 0x0F
+	X axis value, from 0 to 0x0F (0x1F, 0x7F on 12 and 14 bit controllers)
 byte 2:
 	X axis value, from 0 to 0x7F
 
 byte 3:
-	Y axis value, from 0 to 0x0F
+	Y axis value, from 0 to 0x0F (0x1F, 0x7F on 12 and 14 bit controllers)
 byte 4:
 	Y axis value, from 0 to 0x7F
 
+	x = byte1 << 7 | byte2, y = byte3 << 7 | byte4
+
 */
@@ -79,6 +79,16 @@ void uinput_create() {
 	};
 	int r;
 
+	uinput_set_evbit(EV_KEY);
+	uinput_set_evbit(EV_REL);
+
+	uinput_set_keybit(BTN_LEFT);
+	uinput_set_keybit(BTN_MIDDLE);
+	uinput_set_keybit(BTN_RIGHT);
+
+	uinput_set_relbit(REL_X);
+	uinput_set_relbit(REL_Y);
+
 	snprintf(uinput.name, UINPUT_MAX_NAME_SIZE, "psmouse");
 
 	r = write(psmouse_uinput_fd, &uinput, sizeof(uinput));
@@ -126,68 +136,260 @@ static int phys_write(unsigned char byte) {
 	return 0;
 }
 
-void psmouse_interrupt(unsigned char data);
+static void psmouse_probe_start();
+static void psmouse_rescan();
 
-int phys_wait_for_input(int *ptimeout) {
-	unsigned char byte;
-	int r;
+/*
+ * Packets are not written to uinput one by one: the motion of consecutive
+ * packets with the same buttons is summed, and psmouse_flush() writes it as
+ * a single report, with only the buttons that changed, once the whole
+ * batch read from the port has been decoded.
+ */
 
-	if (ptimeout != NULL) {
-		fd_set fds;
-		struct timeval tv;
-
-		FD_ZERO(&fds);
-		FD_SET(fd_serial, &fds);
-		tv.tv_sec=0; tv.tv_usec=*ptimeout;
-		r = select(fd_serial+1, &fds, NULL, &fds, &tv);
-		*ptimeout = tv.tv_sec*1000000 + tv.tv_usec;
-		if (r==-1) { pferrx(); }
-		if (r==0) { return -1; } /* timeout */
-		if (r!=1) { err("cannot select"); exit(1); }
-	}
+static struct {
+	int pending;
+	int dx;
+	int dy;
+	unsigned char buttons;		/* of the pending motion */
+	unsigned char reported;		/* last written to uinput */
+} psmouse_report;
+
+static void psmouse_event(struct input_event *ev, __u16 type, __u16 code, __s32 value) {
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+}
 
-	r = read(fd_serial, &byte, 1);
-	if (r==-1) { pferrx(); }
-	if (r!=1) { err("cannot read"); exit(1); }
+void psmouse_flush() {
+	struct input_event ev[6];
+	unsigned char changed;
+	int n = 0;
+	ssize_t r;
+
+	if (!psmouse_report.pending)
+		return;
+
+	changed = psmouse_report.buttons ^ psmouse_report.reported;
+	if (changed & 1)
+		psmouse_event(&ev[n++], EV_KEY, BTN_LEFT, psmouse_report.buttons & 1);
+	if (changed & 4)
+		psmouse_event(&ev[n++], EV_KEY, BTN_MIDDLE, (psmouse_report.buttons >> 2) & 1);
+	if (changed & 2)
+		psmouse_event(&ev[n++], EV_KEY, BTN_RIGHT, (psmouse_report.buttons >> 1) & 1);
+	if (psmouse_report.dx)
+		psmouse_event(&ev[n++], EV_REL, REL_X, psmouse_report.dx);
+	if (psmouse_report.dy)
+		psmouse_event(&ev[n++], EV_REL, REL_Y, psmouse_report.dy);
+
+	psmouse_report.pending = 0;
+	psmouse_report.dx = 0;
+	psmouse_report.dy = 0;
+	psmouse_report.reported = psmouse_report.buttons;
+
+	if (n == 0)
+		return;
+
+	psmouse_event(&ev[n++], EV_SYN, SYN_REPORT, 0);
+	r = write(psmouse_uinput_fd, ev, n * sizeof(ev[0]));
+	if (r != (ssize_t)(n * sizeof(ev[0]))) { pferrx(); }
+}
 
-	psmouse_interrupt(byte);
-	return 0;
+/*
+ * psmouse_process_packet() analyzes the PS/2 mouse packet contents and
+ * adds them to the pending report.
+ */
+
+static void psmouse_process_packet()
+{
+	unsigned char *packet = psmouse->packet;
+	unsigned char buttons;
+
+/*
+ * Generic PS/2 Mouse
+ */
+
+	buttons = packet[0] & 7;
+
+	/* a button change ends the motion gathered so far */
+	if (psmouse_report.pending && buttons != psmouse_report.buttons)
+		psmouse_flush();
+
+	psmouse_report.buttons = buttons;
+	psmouse_report.dx += packet[1] ? (int) packet[1] - (int) ((packet[0] << 4) & 0x100) : 0;
+	psmouse_report.dy += packet[2] ? (int) ((packet[0] << 3) & 0x100) - (int) packet[2] : 0;
+	psmouse_report.pending = 1;
 }
 
-static int psmouse_reconnect();
+/*
+ * Asynchronous command queue. Commands are sent one byte at a time, each
+ * byte when the previous one has been acknowledged, and the answers are
+ * gathered by psmouse_interrupt() from the bytes the main loop reads, so
+ * touch frames keep flowing while the mouse is probed or reset. Every
+ * command has a deadline, checked by psmouse_poll(), and an optional
+ * callback called with the result.
+ */
 
-static void phys_rescan() {
-	psmouse_disconnect();
-	psmouse_connect();
+#define PSMOUSE_QUEUE		16
+#define PSMOUSE_BYTE_TIMEOUT	100	/* ms */
+#define PSMOUSE_CMD_TIMEOUT	500
+#define PSMOUSE_BAT_TIMEOUT	4000
+#define PSMOUSE_ID_TIMEOUT	100	/* after the first byte of a reset */
+
+struct psmouse_cmd {
+	int command;
+	unsigned char param[4];
+	void (*done)(int ret, unsigned char *param);
+};
+
+static struct {
+	struct psmouse_cmd queue[PSMOUSE_QUEUE];
+	unsigned int head;
+	unsigned int tail;
+	int active;			/* queue[tail] is in progress */
+	unsigned char bytes[5];		/* command byte and parameters */
+	int nbytes;
+	int sent;
+	struct timeval deadline;
+} psmouse_cmds;
+
+static void psmouse_deadline(int ms) {
+	gettimeofday(&psmouse_cmds.deadline, NULL);
+	psmouse_cmds.deadline.tv_usec += ms * 1000;
+	psmouse_cmds.deadline.tv_sec += psmouse_cmds.deadline.tv_usec / 1000000;
+	psmouse_cmds.deadline.tv_usec %= 1000000;
 }
 
-void phys_reconnect() {
-	psmouse_reconnect();
+static void psmouse_command_start();
+
+static void psmouse_command_done(int ret) {
+	struct psmouse_cmd *cmd = &psmouse_cmds.queue[psmouse_cmds.tail % PSMOUSE_QUEUE];
+	struct psmouse_cmd done = *cmd;
+	int receive = (cmd->command >> 8) & 0xf;
+	int i;
+
+	for (i = 0; i < receive; i++)
+		done.param[i] = psmouse->cmdbuf[(receive - 1) - i];
+
+	if (psmouse->cmdcnt)
+		ret = -1;
+
+	psmouse->cmdcnt = 0;
+	psmouse->acking = 0;
+	psmouse_cmds.active = 0;
+	psmouse_cmds.tail++;
+
+	/* the callback may queue the next step */
+	if (done.done)
+		done.done(ret, done.param);
+
+	if (!psmouse_cmds.active && psmouse_cmds.tail != psmouse_cmds.head)
+		psmouse_command_start();
 }
 
+/* send the next byte of the command, or wait for its answer */
+static void psmouse_command_next() {
+	struct psmouse_cmd *cmd = &psmouse_cmds.queue[psmouse_cmds.tail % PSMOUSE_QUEUE];
 
+	if (psmouse_cmds.sent < psmouse_cmds.nbytes) {
+		psmouse->ack = 0;
+		psmouse->acking = 1;
+		phys_write(psmouse_cmds.bytes[psmouse_cmds.sent]);
+		psmouse_deadline(PSMOUSE_BYTE_TIMEOUT);
+		return;
+	}
+
+	if (psmouse->cmdcnt) {
+		psmouse_deadline(cmd->command == PSMOUSE_CMD_RESET_BAT ? PSMOUSE_BAT_TIMEOUT : PSMOUSE_CMD_TIMEOUT);
+		return;
+	}
+
+	psmouse_command_done(0);
+}
+
+static void psmouse_command_start() {
+	struct psmouse_cmd *cmd = &psmouse_cmds.queue[psmouse_cmds.tail % PSMOUSE_QUEUE];
+	int send = (cmd->command >> 12) & 0xf;
+	int receive = (cmd->command >> 8) & 0xf;
+	int i;
+
+	psmouse_cmds.active = 1;
+	psmouse_cmds.nbytes = 0;
+	psmouse_cmds.sent = 0;
+
+	if (cmd->command & 0xff)
+		psmouse_cmds.bytes[psmouse_cmds.nbytes++] = cmd->command & 0xff;
+	for (i = 0; i < send; i++)
+		psmouse_cmds.bytes[psmouse_cmds.nbytes++] = cmd->param[i];
+
+	/* initialize cmdbuf with preset values from param */
+	psmouse->cmdcnt = receive;
+	for (i = 0; i < receive; i++)
+		psmouse->cmdbuf[(receive - 1) - i] = cmd->param[i];
+
+	psmouse_command_next();
+}
 
 /*
- * psmouse_process_packet() analyzes the PS/2 mouse packet contents and
- * reports relevant events to the input module.
+ * psmouse_command() queues a command and its parameters for the mouse.
+ * done() is called with 0 and the answer in param, or -1 on error.
  */
 
-static void psmouse_process_packet()
+int psmouse_command(const unsigned char *param, int command, void (*done)(int ret, unsigned char *param))
 {
-	unsigned char *packet = psmouse->packet;
+	struct psmouse_cmd *cmd;
+	int send = (command >> 12) & 0xf;
+	int receive = (command >> 8) & 0xf;
+	int n = send > receive ? send : receive;
+
+	if (psmouse_cmds.head - psmouse_cmds.tail == PSMOUSE_QUEUE) {
+		warn("command queue full\n");
+		return -1;
+	}
+
+	cmd = &psmouse_cmds.queue[psmouse_cmds.head % PSMOUSE_QUEUE];
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->command = command;
+	if (param != NULL)
+		memcpy(cmd->param, param, n);
+	cmd->done = done;
+	psmouse_cmds.head++;
+
+	if (!psmouse_cmds.active)
+		psmouse_command_start();
+
+	return 0;
+}
+
+/* drop every queued command, without calling their callbacks */
+static void psmouse_command_flush() {
+	psmouse_cmds.tail = psmouse_cmds.head;
+	psmouse_cmds.active = 0;
+	psmouse->cmdcnt = 0;
+	psmouse->acking = 0;
+}
+
+int psmouse_busy() {
+	return psmouse_cmds.active;
+}
 
 /*
- * Generic PS/2 Mouse
+ * psmouse_poll() fails the command in progress when its deadline passed.
+ * Returns the ms until the deadline, or -1 when no command is in progress.
  */
+int psmouse_poll(struct timeval *now) {
+	int left;
 
-	uinput_report_key(BTN_LEFT,    packet[0]       & 1);
-	uinput_report_key(BTN_MIDDLE, (packet[0] >> 2) & 1);
-	uinput_report_key(BTN_RIGHT,  (packet[0] >> 1) & 1);
+	if (!psmouse_cmds.active)
+		return -1;
 
-	uinput_report_rel(REL_X, packet[1] ? (int) packet[1] - (int) ((packet[0] << 4) & 0x100) : 0);
-	uinput_report_rel(REL_Y, packet[2] ? (int) ((packet[0] << 3) & 0x100) - (int) packet[2] : 0);
+	left = (psmouse_cmds.deadline.tv_sec - now->tv_sec) * 1000 +
+	       (psmouse_cmds.deadline.tv_usec - now->tv_usec) / 1000;
+	if (left > 0)
+		return left;
 
-	uinput_sync();
+	psmouse_command_done(-1);
+	return psmouse_poll(now);
 }
 
 /*
@@ -215,11 +417,30 @@ void psmouse_interrupt(unsigned char data)
 				break;
 		}
 		psmouse->acking = 0;
+
+		if (psmouse->ack < 0) {
+			psmouse_command_done(-1);
+			goto out;
+		}
+		psmouse_cmds.sent++;
+		psmouse_command_next();
 		goto out;
 	}
 
 	if (psmouse->cmdcnt) {
+		struct psmouse_cmd *cmd = &psmouse_cmds.queue[psmouse_cmds.tail % PSMOUSE_QUEUE];
+
 		psmouse->cmdbuf[--psmouse->cmdcnt] = data;
+
+		if (psmouse->cmdcnt == 1 && cmd->command == PSMOUSE_CMD_GETID &&
+		    psmouse->cmdbuf[1] != 0xab && psmouse->cmdbuf[1] != 0xac)
+			psmouse->cmdcnt = 0;
+
+		if (psmouse->cmdcnt == 1 && cmd->command == PSMOUSE_CMD_RESET_BAT)
+			psmouse_deadline(PSMOUSE_ID_TIMEOUT);	/* do not wait forever for the id */
+
+		if (psmouse->cmdcnt == 0)
+			psmouse_command_done(0);
 		goto out;
 	}
 
@@ -237,6 +458,7 @@ void psmouse_interrupt(unsigned char data)
 	    &&  jiffies > psmouse->last + 500000) {
 		warn("%s lost synchronization, throwing %d bytes away.\n",
 		       psmouse->name, psmouse->pktcnt);
+		recorder_anomaly(RECORDER_PSMOUSE_SYNC);
 		psmouse->pktcnt = 0;
 	}
 
@@ -252,7 +474,7 @@ void psmouse_interrupt(unsigned char data)
 		if (psmouse->pktcnt == 2) {
 			if (psmouse->packet[1] == PSMOUSE_RET_ID) {
 				psmouse->state = PSMOUSE_IGNORE;
-				phys_rescan();
+				psmouse_rescan();
 				goto out;
 			}
 		}
@@ -268,97 +490,18 @@ out:
 }
 
 /*
- * psmouse_sendbyte() sends a byte to the mouse, and waits for acknowledge.
- * It doesn't handle retransmission, though it could - because when there would
- * be need for retransmissions, the mouse has to be replaced anyway.
- */
-
-static int psmouse_sendbyte(unsigned char byte)
-{
-	int timeout = 10000; /* 100 msec */
-	psmouse->ack = 0;
-	psmouse->acking = 1;
-
-	if (phys_write(byte)) {
-		psmouse->acking = 0;
-		return -1;
-	}
-
-	while (!psmouse->ack && timeout>0)
-		phys_wait_for_input(&timeout);
-
-	return -(psmouse->ack <= 0);
-}
-
-/*
- * psmouse_command() sends a command and its parameters to the mouse,
- * then waits for the response and puts it in the param array.
+ * psmouse_reset() resets the mouse into power-on state.
  */
 
-int psmouse_command(unsigned char *param, int command)
+static void psmouse_reset_done(int ret, unsigned char *param)
 {
-	int timeout = 500000; /* 500 msec */
-	int send = (command >> 12) & 0xf;
-	int receive = (command >> 8) & 0xf;
-	int i;
-
-	psmouse->cmdcnt = receive;
-
-	if (command == PSMOUSE_CMD_RESET_BAT)
-                timeout = 4000000; /* 4 sec */
-
-	/* initialize cmdbuf with preset values from param */
-	if (receive)
-	   for (i = 0; i < receive; i++)
-		psmouse->cmdbuf[(receive - 1) - i] = param[i];
-
-	if (command & 0xff)
-		if (psmouse_sendbyte(command & 0xff))
-			return (psmouse->cmdcnt = 0) - 1;
-
-	for (i = 0; i < send; i++)
-		if (psmouse_sendbyte(param[i]))
-			return (psmouse->cmdcnt = 0) - 1;
-
-	while (psmouse->cmdcnt && timeout>0) {
-
-		if (psmouse->cmdcnt == 1 && command == PSMOUSE_CMD_RESET_BAT &&
-				timeout > 100000) /* do not run in a endless loop */
-			timeout = 100000; /* 1 sec */
-
-		if (psmouse->cmdcnt == 1 && command == PSMOUSE_CMD_GETID &&
-		    psmouse->cmdbuf[1] != 0xab && psmouse->cmdbuf[1] != 0xac) {
-			psmouse->cmdcnt = 0;
-			break;
-		}
-
-		phys_wait_for_input(&timeout);
-	}
-
-	for (i = 0; i < receive; i++)
-		param[i] = psmouse->cmdbuf[(receive - 1) - i];
-
-	if (psmouse->cmdcnt)
-		return (psmouse->cmdcnt = 0) - 1;
-
-	return 0;
+	if (ret || (param[0] != PSMOUSE_RET_BAT && param[1] != PSMOUSE_RET_ID))
+		warn("Failed to reset mouse\n");
 }
 
-
-/*
- * psmouse_reset() resets the mouse into power-on state.
- */
 int psmouse_reset()
 {
-	unsigned char param[2];
-
-	if (psmouse_command(param, PSMOUSE_CMD_RESET_BAT))
-		return -1;
-
-	if (param[0] != PSMOUSE_RET_BAT && param[1] != PSMOUSE_RET_ID)
-		return -1;
-
-	return 0;
+	return psmouse_command(NULL, PSMOUSE_CMD_RESET_BAT, psmouse_reset_done);
 }
 
 
@@ -376,42 +519,6 @@ static int psmouse_extensions()
 	return PSMOUSE_PS2;
 }
 
-/*
- * psmouse_probe() probes for a PS/2 mouse.
- */
-
-static int psmouse_probe()
-{
-	unsigned char param[2];
-
-/*
- * First, we check if it's a mouse. It should send 0x00 or 0x03
- * in case of an IntelliMouse in 4-byte mode or 0x04 for IM Explorer.
- */
-
-	param[0] = 0xa5;
-
-	if (psmouse_command(param, PSMOUSE_CMD_GETID))
-		return -1;
-
-	if (param[0] != 0x00 && param[0] != 0x03 && param[0] != 0x04)
-		return -1;
-
-/*
- * Then we reset and disable the mouse so that it doesn't generate events.
- */
-
-	if (psmouse_command(NULL, PSMOUSE_CMD_RESET_DIS))
-		warn("Failed to reset mouse\n");
-
-/*
- * And here we try to determine if it has any extensions over the
- * basic PS/2 3-button mouse.
- */
-
-	return psmouse->type = psmouse_extensions();
-}
-
 /*
  * Here we set the mouse resolution.
  */
@@ -426,10 +533,10 @@ static void psmouse_set_resolution()
 		param[0] = 2;
 	else if (psmouse_resolution >= 50)
 		param[0] = 1;
-	else if (psmouse_resolution)
+	else
 		param[0] = 0;
 
-        psmouse_command(param, PSMOUSE_CMD_SETRES);
+        psmouse_command(param, PSMOUSE_CMD_SETRES, NULL);
 }
 
 /*
@@ -442,17 +549,30 @@ static void psmouse_set_rate()
 	int i = 0;
 
 	while (rates[i] > psmouse_rate) i++;
-	psmouse_command(rates + i, PSMOUSE_CMD_SETRATE);
+	psmouse_command(rates + i, PSMOUSE_CMD_SETRATE, NULL);
 }
 
 /*
- * psmouse_initialize() initializes the mouse to a sane state.
+ * psmouse_activate() is called when the mouse has been enabled, so that we
+ * get motion reports from it.
  */
 
-static void psmouse_initialize()
+static void psmouse_activate(int ret, unsigned char *param)
 {
-	unsigned char param[2];
+	(void) param;
+
+	if (ret)
+		warn("Failed to enable mouse\n");
+
+	psmouse->state = PSMOUSE_ACTIVATED;
+}
 
+/*
+ * psmouse_initialize() initializes the mouse to a sane state, and enables it.
+ */
+
+static void psmouse_initialize()
+{
 /*
  * We set the mouse report rate, resolution and scaling.
  */
@@ -460,26 +580,96 @@ static void psmouse_initialize()
 	if (psmouse_max_proto != PSMOUSE_PS2) {
 		psmouse_set_rate();
 		psmouse_set_resolution();
-		psmouse_command(NULL, PSMOUSE_CMD_SETSCALE11);
+		psmouse_command(NULL, PSMOUSE_CMD_SETSCALE11, NULL);
 	}
 
 /*
  * We set the mouse into streaming mode.
  */
 
-	psmouse_command(param, PSMOUSE_CMD_SETSTREAM);
+	psmouse_command(NULL, PSMOUSE_CMD_SETSTREAM, NULL);
+	psmouse_command(NULL, PSMOUSE_CMD_ENABLE, psmouse_activate);
 }
 
 /*
- * psmouse_activate() enables the mouse so that we get motion reports from it.
+ * Probing is a chain of commands: get the id, then reset and disable the
+ * mouse. It is retried up to PSMOUSE_PROBE_TRIES times.
  */
 
-static void psmouse_activate()
+#define PSMOUSE_PROBE_TRIES 100
+
+static int probe_tries;
+static int probe_type;		/* type a reconnecting mouse must have, 0 = any */
+
+static void psmouse_probe_failed()
 {
-	if (psmouse_command(NULL, PSMOUSE_CMD_ENABLE))
-		warn("Failed to enable mouse\n");
+	if (++probe_tries < PSMOUSE_PROBE_TRIES) {
+		psmouse_probe_start();
+		return;
+	}
 
-	psmouse->state = PSMOUSE_ACTIVATED;
+	err("cannot connect to device\n");
+	psmouse->state = PSMOUSE_IGNORE;
+}
+
+static void psmouse_probe_reset(int ret, unsigned char *param)
+{
+	(void) param;
+
+	if (ret)
+		warn("Failed to reset mouse\n");
+
+/*
+ * And here we try to determine if it has any extensions over the
+ * basic PS/2 3-button mouse.
+ */
+
+	psmouse->type = psmouse_extensions();
+
+	if (probe_type && psmouse->type != probe_type) {
+		err("mouse type changed on reconnect\n");
+		psmouse->state = PSMOUSE_IGNORE;
+		return;
+	}
+
+	if (!probe_type) {
+		sprintf(psmouse->devname, "%s %s %s",
+			psmouse_protocols[psmouse->type], psmouse->vendor, psmouse->name);
+		info("%s\n", psmouse->devname);
+	}
+
+	psmouse_initialize();
+}
+
+static void psmouse_probe_id(int ret, unsigned char *param)
+{
+	if (DEBUG) printf("probe=%d id=%.02X\n", ret, param[0]);
+
+/*
+ * It should be a mouse. It should send 0x00 or 0x03 in case of an
+ * IntelliMouse in 4-byte mode or 0x04 for IM Explorer.
+ */
+
+	if (ret || (param[0] != 0x00 && param[0] != 0x03 && param[0] != 0x04)) {
+		psmouse_probe_failed();
+		return;
+	}
+
+/*
+ * Then we reset and disable the mouse so that it doesn't generate events.
+ */
+
+	psmouse_command(NULL, PSMOUSE_CMD_RESET_DIS, psmouse_probe_reset);
+}
+
+static void psmouse_probe_start()
+{
+	unsigned char param[2];
+
+	if (DEBUG) printf("probing mouse\n");
+
+	param[0] = 0xa5;
+	psmouse_command(param, PSMOUSE_CMD_GETID, psmouse_probe_id);
 }
 
 /*
@@ -490,6 +680,8 @@ void psmouse_disconnect()
 {
 	psmouse->state = PSMOUSE_CMD_MODE;
 
+	psmouse_command_flush();
+
 	if (psmouse->disconnect)
 		psmouse->disconnect(psmouse);
 
@@ -497,69 +689,41 @@ void psmouse_disconnect()
 }
 
 /*
- * psmouse_connect() is a callback from the serio module when
- * an unhandled serio port is found.
+ * psmouse_connect() starts probing for the mouse. It returns right away,
+ * the mouse is activated from the main loop once it answered.
  */
 int psmouse_connect()
 {
-
-	int probe_ok=0, i;
 	memset(psmouse, 0, sizeof(struct psmouse));
 
-	uinput_set_evbit(EV_KEY);
-	uinput_set_evbit(EV_REL);
-
-	uinput_set_keybit(BTN_LEFT);
-	uinput_set_keybit(BTN_MIDDLE);
-	uinput_set_keybit(BTN_RIGHT);
-
-	uinput_set_relbit(REL_X);
-	uinput_set_relbit(REL_Y);
-
 	psmouse->state = PSMOUSE_CMD_MODE;
 
-	for (i=0;i<100;i++) {
-		if (DEBUG) printf("probing mouse\n");
-		if (probe_ok==1) 
-			break;
-		probe_ok = psmouse_probe();
-		if (DEBUG) printf("probe=%d\n",probe_ok);
-	}
-
-	if (probe_ok <= 0)
-		return -1;
-
-	sprintf(psmouse->devname, "%s %s %s",
-		psmouse_protocols[psmouse->type], psmouse->vendor, psmouse->name);
-	info("%s\n", psmouse->devname);
-
-	psmouse_initialize();
-
-	psmouse_activate();
+	probe_tries = 0;
+	probe_type = 0;
+	psmouse_probe_start();
 
 	return 0;
 }
 
-static int psmouse_reconnect()
+/* the mouse sent a BAT: it was replugged or reset */
+static void psmouse_rescan()
 {
-	int old_type;
+	psmouse_disconnect();
+	psmouse_connect();
+}
 
-	old_type = psmouse->type;
+/*
+ * psmouse_reconnect() probes the mouse again, which must still be of the
+ * same type, and initializes it.
+ */
+void phys_reconnect()
+{
+	psmouse_command_flush();
 
+	probe_type = psmouse->type;
 	psmouse->state = PSMOUSE_CMD_MODE;
 	psmouse->type = psmouse->acking = psmouse->cmdcnt = psmouse->pktcnt = 0;
-	if (psmouse->reconnect) {
-	       if (psmouse->reconnect())
-			return -1;
-	} else if (psmouse_probe() != old_type)
-		return -1;
 
-	/* ok, the device type (and capabilities) match the old one,
-	 * we can continue using it, complete intialization
-	 */
-	psmouse->type = old_type;
-	psmouse_initialize();
-
-	psmouse_activate();
-	return 0;
+	probe_tries = 0;
+	psmouse_probe_start();
 }
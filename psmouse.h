@@ -53,7 +53,7 @@ struct psmouse {
 #define PSMOUSE_IMEX		6
 #define PSMOUSE_SYNAPTICS 	7
 
-extern int psmouse_command(unsigned char *param, int command);
+extern int psmouse_command(const unsigned char *param, int command, void (*done)(int ret, unsigned char *param));
 extern int psmouse_reset(void);
 
 extern void phys_reconnect();
@@ -0,0 +1,147 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "opengalax.h"
+
+/*
+ * Lock-free ring between the reader thread (producer) and the emitter
+ * thread (consumer). head is only written by the producer and tail only by
+ * the consumer; the acquire/release pairs order the slot contents.
+ *
+ * When the emitter falls behind, motion is sacrificed but button edges
+ * never are: the consumer skips the oldest motion sample whenever a newer
+ * one is already queued, and a full queue drops its oldest sample when it
+ * is motion, so the incoming one always gets in. An oldest sample that is
+ * an edge makes the producer wait for room. Since both sides may advance
+ * tail then, it is moved with compare and swap.
+ */
+
+void queue_init (queue_data *q) {
+
+	memset (q, 0, sizeof (*q));
+
+	q->last_click = RELEASE;
+	q->last_popped = RELEASE;
+
+	q->fd_event = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (q->fd_event < 0)
+		die ("error: eventfd");
+}
+
+int queue_push (queue_data *q, const sample_data *s) {
+
+	unsigned int head = q->head;
+	unsigned int tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+	unsigned int depth;
+
+	while (head - tail == QUEUE_SIZE) {
+		if (!q->edge[tail % QUEUE_SIZE] &&
+		    __atomic_compare_exchange_n (&q->tail, &tail, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			tail++;
+			q->dropped++;
+			break;
+		}
+		queue_notify (q);
+		sched_yield ();
+		tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+	}
+
+	q->ring[head % QUEUE_SIZE] = *s;
+	q->edge[head % QUEUE_SIZE] = (s->click != q->last_click);
+	__atomic_store_n (&q->head, head + 1, __ATOMIC_RELEASE);
+
+	q->last_click = s->click;
+	q->pushed++;
+	depth = head + 1 - tail;
+	if (depth > q->max_depth)
+		q->max_depth = depth;
+
+	return 1;
+}
+
+/* wake up the consumer, once per batch of pushes */
+void queue_notify (queue_data *q) {
+
+	uint64_t one = 1;
+
+	if (write (q->fd_event, &one, sizeof (one)) < 0 && errno != EAGAIN)
+		die ("error: eventfd");
+}
+
+/*
+ * queue_wait() blocks the consumer until something was pushed or timeout
+ * ms passed (-1 waits forever). Returns 0 on timeout.
+ */
+int queue_wait (queue_data *q, int timeout) {
+
+	struct pollfd pfd = { .fd = q->fd_event, .events = POLLIN };
+	uint64_t count;
+	int ret;
+
+	ret = poll (&pfd, 1, timeout);
+	if (ret < 0 && errno != EINTR)
+		die ("error: poll");
+	if (ret > 0 && read (q->fd_event, &count, sizeof (count)) < 0 && errno != EAGAIN)
+		die ("error: eventfd");
+	return ret > 0;
+}
+
+int queue_pop (queue_data *q, sample_data *s) {
+
+	unsigned int first = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+	unsigned int head, tail;
+	unsigned long coalesced;
+
+	// a failed swap means the producer dropped the slot being read
+	do {
+		tail = first;
+		head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+		if (tail == head)
+			return 0;
+
+		// under backlog, a motion sample followed by another one is stale
+		coalesced = 0;
+		while (head - tail > QUEUE_SIZE / 2 &&
+		       q->last_popped == PRESS &&
+		       q->ring[tail % QUEUE_SIZE].click == PRESS &&
+		       q->ring[(tail + 1) % QUEUE_SIZE].click == PRESS) {
+			tail++;
+			coalesced++;
+		}
+
+		*s = q->ring[tail % QUEUE_SIZE];
+	} while (!__atomic_compare_exchange_n (&q->tail, &first, tail + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	q->coalesced += coalesced;
+
+	q->last_popped = s->click;
+	return 1;
+}
+
+/* nothing pushed is waiting for the consumer */
+int queue_empty (queue_data *q) {
+	return __atomic_load_n (&q->head, __ATOMIC_SEQ_CST) == __atomic_load_n (&q->tail, __ATOMIC_SEQ_CST);
+}
+
+void queue_stats (queue_data *q) {
+
+	unsigned int head = __atomic_load_n (&q->head, __ATOMIC_RELAXED);
+	unsigned int tail = __atomic_load_n (&q->tail, __ATOMIC_RELAXED);
+
+	printf ("queue: depth=%u max_depth=%u pushed=%lu dropped=%lu coalesced=%lu\n",
+		head - tail, q->max_depth, q->pushed, q->dropped, q->coalesced);
+	fflush (stdout);
+}
@@ -0,0 +1,211 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include "opengalax.h"
+
+/*
+ * Flight recorder. The last RECORDER_BYTES bytes read from the serial port
+ * and the last RECORDER_SAMPLES decoded samples are kept in preallocated
+ * rings, recording them is a couple of copies. When something goes wrong
+ * (see the RECORDER_* anomalies) the rings are written, RECORDER_AFTER ms
+ * later so what followed is in too, as a capture that opengalax-replay
+ * reads. SIGUSR2 writes them right away.
+ */
+
+#define RECORDER_BYTES		(256 * 1024)	/* minutes of traffic at 9600 baud */
+#define RECORDER_READS		16384
+#define RECORDER_SAMPLES	16384
+#define RECORDER_AFTER		1000		/* ms */
+#define RECORDER_HOLDOFF	60000		/* ms between anomaly dumps */
+#define RECORDER_DUMPS		4
+#define RECORDER_FILE		"/var/log/opengalax-recorder-%d.cap"
+
+int recorder_enabled;
+
+static unsigned char bytes[RECORDER_BYTES];
+static unsigned long long bytes_next;
+
+static struct {
+	long long ns;
+	unsigned long long pos;		/* in bytes_next terms */
+	int len;
+} reads[RECORDER_READS];
+static unsigned int reads_next;
+
+static struct {
+	long long ns;
+	int x, y;
+	unsigned char click;
+	unsigned char inside;
+} samples[RECORDER_SAMPLES];
+static unsigned int samples_next;
+
+static const char *anomaly_names[RECORDER_ANOMALIES] = {
+	[RECORDER_CLICK] = "bad_click",
+	[RECORDER_PDU] = "bad_pdu",
+	[RECORDER_PSMOUSE_SYNC] = "psmouse_sync",
+	[RECORDER_INIT] = "init_failed",
+};
+
+static unsigned int anomalies[RECORDER_ANOMALIES];
+static int pending = -1;		/* anomaly waiting to be dumped */
+static struct timeval tv_trigger;
+static struct timeval tv_dumped;
+static int dumps;
+
+void recorder_init (void) {
+	recorder_enabled = 1;
+}
+
+void recorder_raw (const unsigned char *data, int len, struct timespec *now) {
+
+	unsigned int pos = bytes_next % RECORDER_BYTES;
+	unsigned int i = reads_next++ % RECORDER_READS;
+	int first = len < (int) (RECORDER_BYTES - pos) ? len : (int) (RECORDER_BYTES - pos);
+
+	memcpy (bytes + pos, data, first);
+	memcpy (bytes, data + first, len - first);
+
+	reads[i].ns = now->tv_sec * 1000000000LL + now->tv_nsec;
+	reads[i].pos = bytes_next;
+	reads[i].len = len;
+	bytes_next += len;
+}
+
+void recorder_samples (const sample_batch *batch, struct timespec *now) {
+
+	long long ns = now->tv_sec * 1000000000LL + now->tv_nsec;
+	unsigned int i;
+	int n;
+
+	for (n = 0; n < batch->count; n++) {
+		i = samples_next++ % RECORDER_SAMPLES;
+		samples[i].ns = ns;
+		samples[i].x = batch->x[n];
+		samples[i].y = batch->y[n];
+		samples[i].click = batch->click[n];
+		samples[i].inside = batch->inside[n];
+	}
+}
+
+/* called where the anomaly is found, the dump happens in recorder_poll() */
+void recorder_anomaly (int anomaly) {
+
+	if (!recorder_enabled)
+		return;
+
+	anomalies[anomaly]++;
+	if (pending < 0)
+		pending = anomaly;
+}
+
+/* both rings merged by time, oldest first, into a capture */
+static void recorder_write (const char *path) {
+
+	unsigned int r = reads_next > RECORDER_READS ? reads_next - RECORDER_READS : 0;
+	unsigned int s = samples_next > RECORDER_SAMPLES ? samples_next - RECORDER_SAMPLES : 0;
+	unsigned char buf[BATCH_MAX * 5];
+	unsigned int pos;
+	capture_file *c;
+	long long start;
+	int i, len;
+
+	// reads whose bytes were overwritten since are left out
+	while (r != reads_next && reads[r % RECORDER_READS].pos + RECORDER_BYTES < bytes_next)
+		r++;
+
+	if (r != reads_next)
+		start = reads[r % RECORDER_READS].ns;
+	else if (s != samples_next)
+		start = samples[s % RECORDER_SAMPLES].ns;
+	else
+		return;
+	if (s != samples_next && samples[s % RECORDER_SAMPLES].ns < start)
+		start = samples[s % RECORDER_SAMPLES].ns;
+
+	c = capture_open (path, start);
+	if (c == NULL) {
+		fprintf (stderr, "Could not write flight recorder file: %s\n", path);
+		return;
+	}
+
+	while (r != reads_next || s != samples_next) {
+		if (r != reads_next && (s == samples_next || reads[r % RECORDER_READS].ns <= samples[s % RECORDER_SAMPLES].ns)) {
+			i = r++ % RECORDER_READS;
+			len = reads[i].len > (int) sizeof (buf) ? (int) sizeof (buf) : reads[i].len;
+			for (pos = 0; pos < (unsigned int) len; pos++)
+				buf[pos] = bytes[(reads[i].pos + pos) % RECORDER_BYTES];
+			capture_write_raw (c, reads[i].ns, buf, len);
+		} else {
+			i = s++ % RECORDER_SAMPLES;
+			capture_write_sample (c, samples[i].ns, samples[i].x, samples[i].y, samples[i].click, samples[i].inside);
+		}
+	}
+
+	capture_close (c);
+}
+
+/* write the rings now, to the next of the RECORDER_DUMPS files */
+void recorder_dump (const char *why) {
+
+	char path[64];
+
+	if (!recorder_enabled)
+		return;
+
+	snprintf (path, sizeof (path), RECORDER_FILE, dumps++ % RECORDER_DUMPS);
+	recorder_write (path);
+	fprintf (stderr, "flight recorder: %s, written to %s\n", why, path);
+}
+
+/*
+ * recorder_poll() dumps the rings RECORDER_AFTER ms after an anomaly, at
+ * most once every RECORDER_HOLDOFF ms. Returns the ms until the dump, or
+ * -1 when none is pending.
+ */
+int recorder_poll (struct timeval *now) {
+
+	int elapsed;
+
+	if (pending < 0)
+		return -1;
+
+	if (tv_trigger.tv_sec == 0) {
+		if (tv_dumped.tv_sec != 0 &&
+		    (now->tv_sec - tv_dumped.tv_sec) * 1000 + (now->tv_usec - tv_dumped.tv_usec) / 1000 < RECORDER_HOLDOFF) {
+			pending = -1;
+			return -1;
+		}
+		tv_trigger = *now;
+	}
+
+	elapsed = (now->tv_sec - tv_trigger.tv_sec) * 1000 +
+		  (now->tv_usec - tv_trigger.tv_usec) / 1000;
+	if (elapsed < RECORDER_AFTER)
+		return RECORDER_AFTER - elapsed;
+
+	recorder_dump (anomaly_names[pending]);
+	pending = -1;
+	tv_trigger.tv_sec = 0;
+	tv_dumped = *now;
+	return -1;
+}
+
+void recorder_stats (void) {
+
+	int i;
+
+	printf ("recorder:");
+	for (i = 0; i < RECORDER_ANOMALIES; i++)
+		printf (" %s=%u", anomaly_names[i], anomalies[i]);
+	printf (" dumps=%d\n", dumps);
+	fflush (stdout);
+}
@@ -0,0 +1,165 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "opengalax.h"
+#include "opengalax-ring.h"
+
+/*
+ * Shared memory output: every decoded and transformed sample is published
+ * in a memfd ring that local clients map read only (see opengalax-ring.h).
+ * The main loop is the only writer, clients are handed the memfd and an
+ * eventfd of their own by the control thread, and are woken up once per
+ * published batch.
+ */
+
+#define RING_CLIENTS 8
+
+static struct opengalax_ring *ring;
+static int fd_ring = -1;
+
+/*
+ * fd is set by the control thread when a client subscribes. When it goes
+ * away the control thread only sets gone and wakes up the main loop, which
+ * closes the eventfd in ring_reap(), so it is never written after being
+ * closed.
+ */
+static struct {
+	int fd;
+	int gone;
+} clients[RING_CLIENTS] = { [0 ... RING_CLIENTS - 1] = { -1, 0 } };
+
+int ring_init (transform_data *tr) {
+
+	fd_ring = memfd_create ("opengalax-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd_ring < 0)
+		return -1;
+
+	if (ftruncate (fd_ring, sizeof (*ring)) < 0)
+		die ("error: ftruncate");
+
+	ring = mmap (NULL, sizeof (*ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_ring, 0);
+	if (ring == MAP_FAILED)
+		die ("error: mmap");
+
+	// clients cannot resize it under the writer
+	fcntl (fd_ring, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	ring->magic = OPENGALAX_RING_MAGIC;
+	ring->version = OPENGALAX_RING_VERSION;
+	ring->slots = OPENGALAX_RING_SLOTS;
+	ring->sample_size = sizeof (struct opengalax_sample);
+	ring_range (tr);
+
+	return 0;
+}
+
+/* output range, follows the calibration */
+void ring_range (transform_data *tr) {
+
+	if (ring == NULL)
+		return;
+
+	ring->xmin = tr->range_xmin;
+	ring->xmax = tr->range_xmax;
+	ring->ymin = tr->range_ymin;
+	ring->ymax = tr->range_ymax;
+}
+
+/* frees the slots of the clients that went away, main loop only */
+void ring_reap (void) {
+
+	int i, fd;
+
+	for (i = 0; i < RING_CLIENTS; i++) {
+		if (!__atomic_load_n (&clients[i].gone, __ATOMIC_ACQUIRE))
+			continue;
+		fd = clients[i].fd;
+		clients[i].gone = 0;
+		__atomic_store_n (&clients[i].fd, -1, __ATOMIC_RELEASE);
+		close (fd);
+	}
+}
+
+void ring_publish (const sample_batch *batch, struct timespec *now) {
+
+	struct opengalax_sample *slot;
+	uint64_t head = ring->head;
+	uint64_t one = 1;
+	int64_t time_ns = now->tv_sec * 1000000000LL + now->tv_nsec;
+	int i, fd;
+
+	if (batch->count == 0)
+		return;
+
+	for (i = 0; i < batch->count; i++, head++) {
+		slot = &ring->sample[head & (OPENGALAX_RING_SLOTS - 1)];
+		__atomic_store_n (&slot->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence (__ATOMIC_RELEASE);
+		slot->time_ns = time_ns;
+		slot->x = batch->x[i];
+		slot->y = batch->y[i];
+		slot->pressed = (batch->click[i] == PRESS);
+		slot->inside = batch->inside[i];
+		__atomic_store_n (&slot->seq, head + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n (&ring->head, head, __ATOMIC_RELEASE);
+
+	ring_reap ();
+	for (i = 0; i < RING_CLIENTS; i++) {
+		fd = __atomic_load_n (&clients[i].fd, __ATOMIC_ACQUIRE);
+		if (fd < 0)
+			continue;
+		if (write (fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+			die ("error: eventfd");
+	}
+}
+
+/*
+ * ring_subscribe() returns a read only descriptor of the ring and a new
+ * eventfd in *fd_event, or -1 when there is no room for another client.
+ * The return value identifies the client for ring_unsubscribe().
+ */
+int ring_subscribe (int *fd_map, int *fd_event) {
+
+	char path[64];
+	int i, fd;
+
+	for (i = 0; i < RING_CLIENTS; i++)
+		if (__atomic_load_n (&clients[i].fd, __ATOMIC_ACQUIRE) < 0)
+			break;
+	if (i == RING_CLIENTS || ring == NULL)
+		return -1;
+
+	fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	// a read only descriptor, so clients cannot map the ring writable
+	snprintf (path, sizeof (path), "/proc/self/fd/%d", fd_ring);
+	*fd_map = open (path, O_RDONLY | O_CLOEXEC);
+	if (*fd_map < 0) {
+		close (fd);
+		return -1;
+	}
+
+	*fd_event = fd;
+	__atomic_store_n (&clients[i].fd, fd, __ATOMIC_RELEASE);
+	return i;
+}
+
+void ring_unsubscribe (int client) {
+	__atomic_store_n (&clients[client].gone, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,434 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include "opengalax.h"
+
+// input sync signal:
+static const struct input_event ev_sync = { .type = EV_SYN, .code = 0, .value = 0 };
+
+// button press signals:
+static const struct input_event ev_button[4] = {
+	[BTN1_RELEASE] = { .type = EV_KEY, .code = BTN_LEFT, .value = 0 },
+	[BTN1_PRESS] = { .type = EV_KEY, .code = BTN_LEFT, .value = 1 },
+	[BTN2_RELEASE] = { .type = EV_KEY, .code = BTN_RIGHT, .value = 0 },
+	[BTN2_PRESS] = { .type = EV_KEY, .code = BTN_RIGHT, .value = 1 },
+};
+
+static void touch_select (touch_data *t);
+static void debounce_release (touch_data *t, struct timeval *now);
+
+/* gap between the forced release and the right button press */
+#define RIGHTCLICK_GAP 10	/* ms */
+
+/* events are gathered and written to uinput once per report, at the sync */
+static void emit (touch_data *t, const struct input_event *ev) {
+	t->out[t->out_count++] = *ev;
+}
+
+static void emit_sync (touch_data *t) {
+	emit (t, &ev_sync);
+	uinput_write (fd_uinput, t->out, t->out_count);
+	t->out_count = 0;
+}
+
+/* second half of the right click emulation: press the right button */
+static void rightclick_fire (touch_data *t) {
+
+	t->rightclick_pending = 0;
+	if (t->btn2_state != BTN2_PRESS)
+		return;
+
+	emit (t, &ev_button[BTN1_RELEASE]);
+	emit (t, &ev_button[BTN2_PRESS]);
+	emit_sync (t);
+	if (t->foreground)
+		printf ("X: %d Y: %d BTN1: OFF BTN2: ON  FIRST: No\n", t->rightclick_x, t->rightclick_y);
+}
+
+void touch_init (touch_data *t, conf_data *conf, int foreground, int calibration_mode) {
+
+	memset (t, 0, sizeof (*t));
+
+	t->conf = conf;
+	t->foreground = foreground;
+	t->calibration_mode = calibration_mode;
+
+	t->calib_xmin = AXIS_MAX(PANEL_BITS_MAX);
+	t->calib_xmax = 0;
+	t->calib_ymin = AXIS_MAX(PANEL_BITS_MAX);
+	t->calib_ymax = 0;
+
+	t->btn1_state = BTN1_RELEASE;
+	t->btn2_state = BTN2_RELEASE;
+
+	t->scale_x = AXIS_SCALE(PANEL_BITS_MAX);
+	t->scale_y = AXIS_SCALE(PANEL_BITS_MAX);
+
+	reject_init(&t->rejection, conf);
+	hysteresis_init(&t->hysteresis, conf);
+	debounce_init(&t->debounce, conf);
+	liftoff_init(&t->liftoff, conf);
+
+	touch_select(t);
+}
+
+/*
+ * touch_scale() sets the factors from panel values to the uinput axes, the
+ * reader changes them when it finds out the resolution.
+ */
+void touch_scale (touch_data *t, int scale_x, int scale_y) {
+	__atomic_store_n (&t->scale_x, scale_x, __ATOMIC_RELAXED);
+	__atomic_store_n (&t->scale_y, scale_y, __ATOMIC_RELAXED);
+}
+
+/*
+ * touch_resume() is called by the reader when the system resumed, the next
+ * press reports how long the first touch took. It may run in another thread
+ * than touch_sample().
+ */
+void touch_resume (touch_data *t, struct timeval *now) {
+	t->tv_resume = *now;
+	__atomic_store_n (&t->resume_pending, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * touch_poll() presses the right button once the right click gap elapsed
+ * and reports a release the debouncer held back once it is due. Returns
+ * the ms until the next deadline, the lift-off one included, or -1 if
+ * there is none.
+ */
+int touch_poll (touch_data *t, struct timeval *now) {
+
+	int lift, held, gap = -1;
+
+	if (t->rightclick_pending) {
+		gap = RIGHTCLICK_GAP - ((now->tv_sec - t->tv_rightclick.tv_sec) * 1000 +
+					(now->tv_usec - t->tv_rightclick.tv_usec) / 1000);
+		if (gap <= 0) {
+			rightclick_fire (t);
+			gap = -1;
+		}
+	}
+
+	held = debounce_poll(&t->debounce, now);
+	if (held == 0) {
+		debounce_release (t, now);
+		held = -1;
+	}
+
+	lift = liftoff_poll(&t->liftoff, now);
+	if (held >= 0 && (gap < 0 || held < gap))
+		gap = held;
+	if (gap >= 0 && (lift < 0 || gap < lift))
+		return gap;
+	return lift;
+}
+
+/*
+ * touch_timeout() is called when a wait for the panel timed out. A lift-off
+ * deadline that passed then is not a stall of the reader with frames still
+ * waiting to be read: the finger is gone but its RELEASE frame was lost.
+ */
+void touch_timeout (touch_data *t, struct timeval *now) {
+
+	if (liftoff_poll(&t->liftoff, now) != 0)
+		return;
+
+	liftoff_arm(&t->liftoff, 0);
+	emit (t, &ev_button[BTN1_RELEASE]);
+	if (t->conf->rightclick_enable)
+		emit (t, &ev_button[BTN2_RELEASE]);
+	emit_sync (t);
+	t->btn1_state = BTN1_RELEASE;
+	t->btn2_state = BTN2_RELEASE;
+	t->rightclick_pending = 0;
+	reject_reset(&t->rejection);
+	debounce_reset(&t->debounce);
+	if (t->foreground)
+		printf ("lift-off: RELEASE frame lost, buttons released\n");
+}
+
+/* nothing arrived for TOUCH_IDLE ms */
+void touch_idle (touch_data *t) {
+	t->rightclick_pending = 0;
+	t->btn1_state = BTN1_RELEASE;
+	t->btn2_state = BTN2_RELEASE;
+	reject_reset(&t->rejection);
+	debounce_reset(&t->debounce);
+}
+
+void touch_stats (touch_data *t) {
+	printf ("debounce: presses=%u releases=%u suppressed\n", t->debounce.presses, t->debounce.releases);
+	fflush (stdout);
+}
+
+/*
+ * Noise estimate for the fuzz values: a histogram of the distance between
+ * consecutive samples of a press. Bigger distances are finger motion.
+ */
+#define NOISE_SAMPLES 200
+
+static int noise_fuzz (const unsigned int *hist) {
+
+	unsigned int total = 0, sum = 0;
+	int i;
+
+	for (i = 0; i < NOISE_MAX; i++)
+		total += hist[i];
+	if (total < NOISE_SAMPLES)
+		return 0;
+
+	// 9 out of 10 wobbles stay below the fuzz
+	for (i = 0; i < NOISE_MAX; i++) {
+		sum += hist[i];
+		if (sum * 10 >= total * 9)
+			break;
+	}
+	return i + 1;
+}
+
+/* calibration mode: only show the calibration values and the noise */
+static void touch_calibrate (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now) {
+
+	int dx, dy;
+
+	(void) inside;
+	(void) now;
+
+	if (x > t->calib_xmax)
+		t->calib_xmax=x;
+	if (y > t->calib_ymax)
+		t->calib_ymax=y;
+	if (x < t->calib_xmin && x!=0)
+		t->calib_xmin=x;
+	if (y < t->calib_ymin && y!=0)
+		t->calib_ymin=y;
+
+	if (click == PRESS) {
+		if (t->calib_pressed) {
+			dx = abs (x - t->calib_last_x);
+			dy = abs (y - t->calib_last_y);
+			if (dx < NOISE_MAX && dy < NOISE_MAX) {
+				t->noise_x[dx]++;
+				t->noise_y[dy]++;
+			}
+		}
+		t->calib_pressed = 1;
+		t->calib_last_x = x;
+		t->calib_last_y = y;
+	} else
+		t->calib_pressed = 0;
+
+	printf("     xmin=%d  xmax=%d  ymin=%d  ymax=%d  fuzz_x=%d  fuzz_y=%d          \r", t->calib_xmin, t->calib_xmax, t->calib_ymin, t->calib_ymax,
+		noise_fuzz(t->noise_x), noise_fuzz(t->noise_y));
+	fflush(stdout);
+}
+
+/*
+ * touch_process() runs a decoded and transformed sample through rejection,
+ * the button state machine and right click emulation, and writes the
+ * resulting events to uinput. It is always inlined, so the variants below
+ * get 'rightclick' and 'foreground' as constants and lose those branches.
+ */
+static inline __attribute__ ((always_inline))
+void touch_process (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now,
+		    const int rightclick, const int foreground) {
+
+	struct input_event ev[2];
+	int old_btn1_state, old_btn2_state;
+	int first_click;
+
+	// the right click gap is over once the next report arrives
+	if (t->rightclick_pending)
+		rightclick_fire (t);
+
+	liftoff_frame(&t->liftoff, click, now);
+
+	// drop bezel, palm and short burst samples
+	if (reject_sample(&t->rejection, click, x, y, inside, now))
+		return;
+
+	if (click == PRESS && __atomic_load_n (&t->resume_pending, __ATOMIC_ACQUIRE)) {
+		t->resume_pending = 0;
+		if (foreground)
+			printf("resume: first touch after %ld ms\n",
+				(now->tv_sec - t->tv_resume.tv_sec) * 1000 + (now->tv_usec - t->tv_resume.tv_usec) / 1000);
+	}
+
+	old_btn1_state = t->btn1_state;
+	old_btn2_state = t->btn2_state;
+
+	switch (click) {
+		case PRESS:
+			if (old_btn1_state == BTN1_RELEASE && old_btn2_state == BTN2_RELEASE) {
+				t->btn1_state = BTN1_PRESS;
+				t->btn2_state = BTN2_RELEASE;
+			}
+			break;
+		case RELEASE:
+			t->btn1_state = BTN1_RELEASE;
+			t->btn2_state = BTN2_RELEASE;
+			break;
+	}
+
+	// If this is the first panel event, track time for right click
+	first_click = 0;
+	if (old_btn1_state == BTN1_RELEASE && t->btn1_state == BTN1_PRESS)
+	{
+		first_click = 1;
+		t->tv_btn2_click = *now;
+	}
+
+	// load X,Y into input_events
+	memset (ev, 0, sizeof (ev));
+	ev[0].type = EV_ABS;
+	ev[0].code = ABS_X;
+	ev[0].value = AXIS_SCALED(x, __atomic_load_n (&t->scale_x, __ATOMIC_RELAXED));
+	ev[1].type = EV_ABS;
+	ev[1].code = ABS_Y;
+	ev[1].value = AXIS_SCALED(y, __atomic_load_n (&t->scale_y, __ATOMIC_RELAXED));
+
+	// the right click is measured from where the finger landed, even
+	// without hysteresis
+	if (first_click) {
+		t->prev_x = x;
+		t->prev_y = y;
+	}
+
+	// Only move to posision of click until the finger really moves - prevents accidental dragging.
+	if (hysteresis_sample (&t->hysteresis, first_click, x, y, now))
+	{
+		// send X,Y
+		emit (t, &ev[0]);
+		emit (t, &ev[1]);
+	} else {
+		// store position for right click management
+		t->prev_x = x;
+		t->prev_y = y;
+	}
+
+	if (rightclick) {
+
+		// emulate right click by press and hold
+		if (time_elapsed_ms (&t->tv_btn2_click, now, t->conf->rightclick_duration)) {
+			if ( ( x-(t->conf->rightclick_range/2) < t->prev_x && t->prev_x < x+(t->conf->rightclick_range/2) ) && 
+			     ( y-(t->conf->rightclick_range/2) < t->prev_y && t->prev_y < y+(t->conf->rightclick_range/2) ) ) {
+				t->btn2_state=BTN2_PRESS;
+				t->btn1_state=BTN1_RELEASE;
+			}
+		}
+
+		// reset the start click counter and store position (allows select text + rightclick)
+		if (time_elapsed_ms (&t->tv_btn2_click, now, t->conf->rightclick_duration*2) && t->btn2_state == BTN2_RELEASE) {
+			t->tv_btn2_click = *now;
+			t->prev_x = x;
+			t->prev_y = y;
+		}
+
+		// force button2 transition: release everything now, and press
+		// button2 from touch_poll() once the gap elapsed
+		if (old_btn2_state == BTN2_RELEASE && t->btn2_state == BTN2_PRESS)
+		{
+			emit (t, &ev_button[BTN1_RELEASE]);
+			emit (t, &ev_button[BTN2_RELEASE]);
+			emit_sync (t);
+			if (foreground)
+				printf ("X: %d Y: %d BTN1: OFF BTN2: OFF FIRST: %s\n", x, y,
+				first_click == 0 ? "No" : first_click == 1 ? "Yes" : "Unknown");
+
+			t->rightclick_pending = 1;
+			t->tv_rightclick = *now;
+			t->rightclick_x = x;
+			t->rightclick_y = y;
+			liftoff_arm(&t->liftoff, 1);
+			return;
+		}
+
+		// clicking button2
+		emit (t, &ev_button[t->btn2_state]);
+	}
+
+	// clicking button1
+	emit (t, &ev_button[t->btn1_state]);
+
+	// Sync
+	emit_sync (t);
+
+	liftoff_arm(&t->liftoff, t->btn1_state == BTN1_PRESS || t->btn2_state == BTN2_PRESS);
+
+	if (foreground)
+		printf ("X: %d Y: %d BTN1: %s BTN2: %s FIRST: %s\n", x, y,
+			t->btn1_state == BTN1_RELEASE ? "OFF" : t->btn1_state == BTN1_PRESS ? "ON " : "Unknown",
+			t->btn2_state == BTN2_RELEASE ? "OFF" : t->btn2_state == BTN2_PRESS ? "ON " : "Unknown",
+			first_click == 0 ? "No" : first_click == 1 ? "Yes" : "Unknown");
+}
+
+/* touch_process() behind the chatter debouncer */
+static inline __attribute__ ((always_inline))
+void touch_debounced (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now,
+		      const int rightclick, const int foreground) {
+
+	switch (debounce_sample (&t->debounce, click, x, y, now)) {
+		case DEBOUNCE_DROP:
+			// the frame still counts for the lift-off detector
+			liftoff_frame(&t->liftoff, click, now);
+			return;
+		case DEBOUNCE_FLUSH:
+			touch_process (t, RELEASE, t->debounce.release_x, t->debounce.release_y, 1, now, rightclick, foreground);
+			break;
+	}
+
+	touch_process (t, click, x, y, inside, now, rightclick, foreground);
+}
+
+/* the release held back by the debouncer is due */
+static void debounce_release (touch_data *t, struct timeval *now) {
+	touch_process (t, RELEASE, t->debounce.release_x, t->debounce.release_y, 1, now,
+		       t->conf->rightclick_enable, t->foreground);
+}
+
+/* generic version, reads the configuration from t */
+void touch_sample (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now) {
+
+	if (t->calibration_mode == CALIBRATE_MINMAX) {
+		touch_calibrate (t, click, x, y, inside, now);
+		return;
+	}
+	if (t->calibration_mode == CALIBRATE_MESH) {
+		mesh_sample (t, click, x, y, inside, now);
+		return;
+	}
+
+	touch_debounced (t, click, x, y, inside, now, t->conf->rightclick_enable, t->foreground);
+}
+
+#define TOUCH_VARIANT(name, rightclick, foreground) \
+static void name (touch_data *t, unsigned char click, int x, int y, int inside, struct timeval *now) { \
+	touch_debounced (t, click, x, y, inside, now, rightclick, foreground); \
+}
+
+TOUCH_VARIANT(touch_plain, 0, 0)
+TOUCH_VARIANT(touch_foreground, 0, 1)
+TOUCH_VARIANT(touch_rightclick, 1, 0)
+TOUCH_VARIANT(touch_rightclick_foreground, 1, 1)
+
+/* pick the variant built for the configuration of t */
+static void touch_select (touch_data *t) {
+
+	if (t->calibration_mode == CALIBRATE_MINMAX)
+		t->sample = touch_calibrate;
+	else if (t->calibration_mode == CALIBRATE_MESH)
+		t->sample = mesh_sample;
+	else if (t->conf->rightclick_enable)
+		t->sample = t->foreground ? touch_rightclick_foreground : touch_rightclick;
+	else
+		t->sample = t->foreground ? touch_foreground : touch_plain;
+}
@@ -0,0 +1,155 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include <sys/syscall.h>
+#include "opengalax.h"
+
+/*
+ * Pipeline tracing. Every TRACE() stage records its start and duration in
+ * a preallocated ring holding the last TRACE_EVENTS stages, written out as
+ * Chrome trace JSON (which Perfetto and chrome://tracing open) on SIGUSR2
+ * and on exit. When tracing is off a stage costs the trace_enabled test.
+ * Several threads record stages: each slot is published with the sequence
+ * number of its stage, and the dump leaves out slots that are still being
+ * written or were overwritten meanwhile.
+ */
+
+#define TRACE_EVENTS 65536
+#define TRACE_FILE "/var/log/opengalax-trace.json"
+
+int trace_enabled;
+
+static struct {
+	unsigned int seq;	/* stage number + 1 once complete, 0 while written */
+	long long ts;		/* ns, CLOCK_MONOTONIC */
+	int dur;
+	short stage;
+	short thread;
+} events[TRACE_EVENTS];
+
+static unsigned int trace_next;
+
+/* thread index, as set by trace_thread() */
+static __thread int trace_thread_id;
+
+#define TRACE_THREADS 4
+static const char *thread_names[TRACE_THREADS] = { "main" };
+static pid_t thread_tids[TRACE_THREADS];
+
+static const char *stage_names[TRACE_STAGES] = {
+	[TRACE_WAIT] = "wait",
+	[TRACE_READ] = "read",
+	[TRACE_DECODE] = "decode",
+	[TRACE_TRANSFORM] = "transform",
+	[TRACE_RING] = "ring publish",
+	[TRACE_DELIVER] = "deliver",
+	[TRACE_TOUCH] = "touch",
+	[TRACE_WRITE] = "uinput write",
+	[TRACE_PSMOUSE] = "psmouse",
+	[TRACE_INJECT] = "inject",
+};
+
+/* writes reach uinput through here while tracing */
+static void (*trace_uinput_write) (int fd, const struct input_event *ev, int count);
+
+static void trace_write (int fd, const struct input_event *ev, int count) {
+	TRACE(TRACE_WRITE, trace_uinput_write (fd, ev, count));
+}
+
+long long trace_clock (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_record (int stage, long long t0) {
+
+	unsigned int n = __atomic_fetch_add (&trace_next, 1, __ATOMIC_RELAXED);
+	unsigned int i = n % TRACE_EVENTS;
+
+	__atomic_store_n (&events[i].seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	events[i].ts = t0;
+	events[i].dur = trace_clock () - t0;
+	events[i].stage = stage;
+	events[i].thread = trace_thread_id;
+	__atomic_store_n (&events[i].seq, n + 1, __ATOMIC_RELEASE);
+}
+
+/* name the calling thread in the trace */
+void trace_thread (int id, const char *name) {
+	trace_thread_id = id;
+	thread_names[id] = name;
+	thread_tids[id] = syscall (SYS_gettid);
+}
+
+/*
+ * trace_init() is called once the uinput writer is chosen, it is wrapped
+ * so the writes show up as a stage of their own.
+ */
+void trace_init (void) {
+
+	trace_thread (0, "main");
+
+	trace_uinput_write = uinput_write;
+	uinput_write = trace_write;
+
+	trace_enabled = 1;
+}
+
+/* oldest stage first, timestamps in us as the format wants */
+void trace_dump (void) {
+
+	unsigned int next = __atomic_load_n (&trace_next, __ATOMIC_RELAXED);
+	unsigned int i, first = next > TRACE_EVENTS ? next - TRACE_EVENTS : 0;
+	pid_t pid = getpid ();
+	unsigned int seq;
+	long long ts;
+	FILE *fd;
+	int t, dur, stage, thread;
+
+	if (!trace_enabled)
+		return;
+
+	fd = fopen (TRACE_FILE, "w");
+	if (fd == NULL) {
+		fprintf (stderr, "Could not write trace file: %s\n", TRACE_FILE);
+		return;
+	}
+
+	fprintf (fd, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf (fd, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"opengalax\"}}", pid);
+	for (t = 0; t < TRACE_THREADS; t++)
+		if (thread_tids[t])
+			fprintf (fd, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				 pid, thread_tids[t], thread_names[t]);
+
+	for (i = first; i != next; i++) {
+		t = i % TRACE_EVENTS;
+		seq = __atomic_load_n (&events[t].seq, __ATOMIC_ACQUIRE);
+		ts = events[t].ts;
+		dur = events[t].dur;
+		stage = events[t].stage;
+		thread = events[t].thread;
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		// still being written, or already another stage
+		if (seq != i + 1 || __atomic_load_n (&events[t].seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		fprintf (fd, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld,\"dur\":%d.%03d}",
+			 stage_names[stage], pid, thread_tids[thread],
+			 ts / 1000, ts % 1000, dur / 1000, dur % 1000);
+	}
+
+	fprintf (fd, "\n]}\n");
+	fclose (fd);
+}
@@ -0,0 +1,401 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include <stddef.h>
+#include "opengalax.h"
+
+/*
+ * Every direction is an affine transform of the decoded panel values
+ * u = xa<<7|xb and v = ya<<7|yb, so the per-sample switch on
+ * conf.direction becomes a set of coefficients computed once here, and
+ * transform_init() picks a transform_batch() variant built for them.
+ * The offsets are in units of the axis range, which depends on the
+ * resolution of the controller. The mapping to a region of the screen
+ * (screen_width and map_* in the config file) is folded into the same
+ * coefficients.
+ */
+
+static const int directions[8][6] = {
+	/*  cx  xu  xv  cy  yu  yv */
+	{   0,  1,  0,  1,  0, -1 },	/* 0: normal */
+	{   1, -1,  0,  1,  0, -1 },	/* 1: invert X */
+	{   0,  1,  0,  0,  0,  1 },	/* 2: invert Y */
+	{   1, -1,  0,  0,  0,  1 },	/* 3: invert X and Y */
+	{   1,  0, -1,  0,  1,  0 },	/* 4: swap X with Y */
+	{   0,  0,  1,  0,  1,  0 },	/* 5: swap, invert X */
+	{   1,  0, -1,  1, -1,  0 },	/* 6: swap, invert Y */
+	{   0,  0,  1,  1, -1,  0 },	/* 7: swap, invert X and Y */
+};
+
+/*
+ * The nonlinearity mesh (mesh= in the config file) is a few control points
+ * per side over the calibrated area. transform_mesh() interpolates them
+ * into MESH_LUT cells over the whole panel range, a power of two, so the
+ * cell and the position in it are shifts and masks of the panel values.
+ */
+#define MESH_LUT_BITS 6
+#define MESH_LUT (1 << MESH_LUT_BITS)
+#define MESH_CORRECTION_MAX 4096
+
+static short mesh_du[MESH_LUT + 1][MESH_LUT + 1];
+static short mesh_dv[MESH_LUT + 1][MESH_LUT + 1];
+
+/*
+ * transform_kernel() decodes, orients, clamps to the calibration values and
+ * edge-tests every sample in the batch. The loop has no branches and no
+ * dependencies between samples, so the compiler can vectorize it. It is
+ * always inlined, so the variants below get the direction coefficients as
+ * constants and the multiplications by 0 and 1 disappear. With mesh, the
+ * panel values are first corrected by a bilinear lookup in the mesh table.
+ */
+static inline __attribute__ ((always_inline))
+void transform_kernel (const transform_data *tr, sample_batch *batch, const int xu, const int xv, const int yu, const int yv, const int shift, const int mesh) {
+
+	const unsigned char * restrict xa = batch->xa;
+	const unsigned char * restrict xb = batch->xb;
+	const unsigned char * restrict ya = batch->ya;
+	const unsigned char * restrict yb = batch->yb;
+	int * restrict bx = batch->x;
+	int * restrict by = batch->y;
+	unsigned char * restrict inside = batch->inside;
+	int i, n = batch->count;
+
+	// local copies, so the stores below can not alias the coefficients
+	const int cx = tr->cx, cy = tr->cy;
+	const int xmin = tr->xmin, xmax = tr->xmax, ymin = tr->ymin, ymax = tr->ymax;
+	const int exmin = tr->edge_xmin, exmax = tr->edge_xmax;
+	const int eymin = tr->edge_ymin, eymax = tr->edge_ymax;
+	const int ms = tr->mesh_shift, mmax = tr->mesh_max;
+	const int mone = 1 << ms, mmask = mone - 1;
+	const int mround = (1 << (2 * ms)) >> 1;
+
+	for (i = 0; i < n; i++) {
+		int u = (xa[i] << 7) | xb[i];
+		int v = (ya[i] << 7) | yb[i];
+		if (mesh) {
+			int mu = u > mmax ? mmax : u;
+			int mv = v > mmax ? mmax : v;
+			int iu = mu >> ms, iv = mv >> ms;
+			int fu = mu & mmask, fv = mv & mmask;
+			int w00 = (mone - fu) * (mone - fv), w01 = fu * (mone - fv);
+			int w10 = (mone - fu) * fv, w11 = fu * fv;
+			u += (mesh_du[iv][iu] * w00 + mesh_du[iv][iu + 1] * w01 +
+			      mesh_du[iv + 1][iu] * w10 + mesh_du[iv + 1][iu + 1] * w11 + mround) >> (2 * ms);
+			v += (mesh_dv[iv][iu] * w00 + mesh_dv[iv][iu + 1] * w01 +
+			      mesh_dv[iv + 1][iu] * w10 + mesh_dv[iv + 1][iu + 1] * w11 + mround) >> (2 * ms);
+		}
+		int x = (cx + xu * u + xv * v) >> shift;
+		int y = (cy + yu * u + yv * v) >> shift;
+
+		x = x < xmin ? xmin : x;
+		x = x > xmax ? xmax : x;
+		y = y < ymin ? ymin : y;
+		y = y > ymax ? ymax : y;
+
+		bx[i] = x;
+		by[i] = y;
+		inside[i] = (x >= exmin) & (x <= exmax) & (y >= eymin) & (y <= eymax);
+	}
+}
+
+/* generic version, reads the coefficients from tr */
+void transform_batch (const transform_data *tr, sample_batch *batch) {
+	transform_kernel (tr, batch, tr->xu, tr->xv, tr->yu, tr->yv, tr->shift, 0);
+}
+
+/* generic version with the nonlinearity correction */
+static void transform_batch_mesh (const transform_data *tr, sample_batch *batch) {
+	transform_kernel (tr, batch, tr->xu, tr->xv, tr->yu, tr->yv, tr->shift, 1);
+}
+
+/* samples already in screen coordinates, only clamped and edge tested */
+void transform_clip (const transform_data *tr, sample_batch *batch) {
+
+	int i, x, y;
+
+	for (i = 0; i < batch->count; i++) {
+		x = batch->x[i];
+		y = batch->y[i];
+		x = x < tr->xmin ? tr->xmin : x > tr->xmax ? tr->xmax : x;
+		y = y < tr->ymin ? tr->ymin : y > tr->ymax ? tr->ymax : y;
+		batch->x[i] = x;
+		batch->y[i] = y;
+		batch->inside[i] = (x >= tr->edge_xmin) & (x <= tr->edge_xmax) &
+				   (y >= tr->edge_ymin) & (y <= tr->edge_ymax);
+	}
+}
+
+#define TRANSFORM_VARIANT(name, xu, xv, yu, yv) \
+static void name (const transform_data *tr, sample_batch *batch) { \
+	transform_kernel (tr, batch, (xu) * FIXED_ONE, (xv) * FIXED_ONE, (yu) * FIXED_ONE, (yv) * FIXED_ONE, FIXED_SHIFT, 0); \
+}
+
+TRANSFORM_VARIANT(transform_xy, 1, 0, 0, 1)
+TRANSFORM_VARIANT(transform_xy_inv_y, 1, 0, 0, -1)
+TRANSFORM_VARIANT(transform_xy_inv_x, -1, 0, 0, 1)
+TRANSFORM_VARIANT(transform_xy_inv_xy, -1, 0, 0, -1)
+TRANSFORM_VARIANT(transform_yx, 0, 1, 1, 0)
+TRANSFORM_VARIANT(transform_yx_inv_y, 0, 1, -1, 0)
+TRANSFORM_VARIANT(transform_yx_inv_x, 0, -1, 1, 0)
+TRANSFORM_VARIANT(transform_yx_inv_xy, 0, -1, -1, 0)
+
+static const struct {
+	int xu, xv, yu, yv;
+	void (*batch) (const transform_data *tr, sample_batch *batch);
+} variants[] = {
+	{  1,  0,  0,  1, transform_xy },
+	{  1,  0,  0, -1, transform_xy_inv_y },
+	{ -1,  0,  0,  1, transform_xy_inv_x },
+	{ -1,  0,  0, -1, transform_xy_inv_xy },
+	{  0,  1,  1,  0, transform_yx },
+	{  0,  1, -1,  0, transform_yx_inv_y },
+	{  0, -1,  1,  0, transform_yx_inv_x },
+	{  0, -1, -1,  0, transform_yx_inv_xy },
+};
+
+/* pick the variant built for the coefficients of tr, or the generic one */
+static void transform_select (transform_data *tr) {
+
+	size_t i;
+
+	tr->batch = tr->mesh ? transform_batch_mesh : transform_batch;
+	if (tr->shift != FIXED_SHIFT || tr->mesh)
+		return;
+	for (i = 0; i < sizeof (variants) / sizeof (variants[0]); i++) {
+		if (tr->xu == variants[i].xu * FIXED_ONE && tr->xv == variants[i].xv * FIXED_ONE &&
+		    tr->yu == variants[i].yu * FIXED_ONE && tr->yv == variants[i].yv * FIXED_ONE) {
+			tr->batch = variants[i].batch;
+			break;
+		}
+	}
+}
+
+/* an axis of the transform fits in 32 bits for any panel value */
+static int transform_fits (long long c, long long a, long long b) {
+
+	const long long m = AXIS_MAX(PANEL_BITS_MAX);
+	long long corner[4] = { c, c + a * m, c + b * m, c + (a + b) * m };
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (corner[i] < -2147483647LL || corner[i] > 2147483647LL)
+			return 0;
+	return 1;
+}
+
+/* v / 2^drop, rounded */
+static long long transform_round (long long v, int drop) {
+	return drop ? (v + (1LL << (drop - 1))) >> drop : v;
+}
+
+/*
+ * transform_direction() only changes the coefficients and the variant, so
+ * the main loop can switch directions between two batches: every sample
+ * is transformed either the old way or the new one.
+ */
+void transform_direction (transform_data *tr, int direction, int bits) {
+
+	const int *d;
+	long long cx, xu, xv, cy, yu, yv;
+	int drop;
+
+	if (direction < 0 || direction > 7)
+		d = directions[0];
+	else
+		d = directions[direction];
+
+	cx = (long long) d[0] * AXIS_MAX(bits) * tr->scale_x + tr->offset_x;
+	xu = (long long) d[1] * tr->scale_x;
+	xv = (long long) d[2] * tr->scale_x;
+	cy = (long long) d[3] * AXIS_MAX(bits) * tr->scale_y + tr->offset_y;
+	yu = (long long) d[4] * tr->scale_y;
+	yv = (long long) d[5] * tr->scale_y;
+
+	// a mapping to a large screen may need a few bits less of precision
+	cx += FIXED_ONE / 2;
+	cy += FIXED_ONE / 2;
+	for (drop = 0; drop < FIXED_SHIFT; drop++)
+		if (transform_fits (transform_round (cx, drop), transform_round (xu, drop), transform_round (xv, drop)) &&
+		    transform_fits (transform_round (cy, drop), transform_round (yu, drop), transform_round (yv, drop)))
+			break;
+
+	tr->shift = FIXED_SHIFT - drop;
+	tr->cx = transform_round (cx, drop);
+	tr->xu = transform_round (xu, drop);
+	tr->xv = transform_round (xv, drop);
+	tr->cy = transform_round (cy, drop);
+	tr->yu = transform_round (yu, drop);
+	tr->yv = transform_round (yv, drop);
+
+	transform_select (tr);
+}
+
+/*
+ * The axis ranges of the output: the whole virtual screen when mapping to
+ * a region of it, otherwise the calibration values.
+ */
+void transform_range (conf_data *conf, calibration_data *calibration, int *xmin, int *xmax, int *ymin, int *ymax) {
+
+	if (conf->screen_width > 0 && conf->screen_height > 0) {
+		*xmin = 0;
+		*xmax = conf->screen_width - 1;
+		*ymin = 0;
+		*ymax = conf->screen_height - 1;
+	} else {
+		*xmin = calibration->xmin;
+		*xmax = calibration->xmax;
+		*ymin = calibration->ymin;
+		*ymax = calibration->ymax;
+	}
+}
+
+/* scale and offset taking min..max onto the size pixels from pos, of total */
+static void transform_map_axis (int min, int max, int pos, int size, int total, int *scale, long long *offset) {
+
+	if (pos < 0 || pos >= total)
+		pos = 0;
+	if (size <= 0 || pos + size > total)
+		size = total - pos;
+
+	if (max > min)
+		*scale = (((long long) (size - 1) << FIXED_SHIFT) + (max - min) / 2) / (max - min);
+	else
+		*scale = FIXED_ONE;
+	*offset = ((long long) pos << FIXED_SHIFT) - (long long) min * *scale;
+}
+
+/* panel values of screen position x, y: the directions only swap and invert axes */
+void transform_raw (int direction, int bits, int x, int y, int *u, int *v) {
+
+	const int *d = directions[direction < 0 || direction > 7 ? 0 : direction];
+
+	if (d[1])
+		*u = (x - d[0] * AXIS_MAX(bits)) * d[1];
+	else
+		*v = (x - d[0] * AXIS_MAX(bits)) * d[2];
+	if (d[4])
+		*u = (y - d[3] * AXIS_MAX(bits)) * d[4];
+	else
+		*v = (y - d[3] * AXIS_MAX(bits)) * d[5];
+}
+
+/* the calibrated area in panel values, which the mesh covers */
+void transform_raw_box (calibration_data *calibration, int direction, int bits, int *u0, int *u1, int *v0, int *v1) {
+
+	int ua, va, ub, vb;
+
+	transform_raw (direction, bits, calibration->xmin, calibration->ymin, &ua, &va);
+	transform_raw (direction, bits, calibration->xmax, calibration->ymax, &ub, &vb);
+	*u0 = ua < ub ? ua : ub;
+	*u1 = ua < ub ? ub : ua;
+	*v0 = va < vb ? va : vb;
+	*v1 = va < vb ? vb : va;
+}
+
+/* Catmull-Rom spline through p1 and p2, at t from 0 to 1 */
+static double mesh_cubic (double p0, double p1, double p2, double p3, double t) {
+	return p1 + 0.5 * t * (p2 - p0 + t * (2 * p0 - 5 * p1 + 4 * p2 - p3 + t * (3 * (p1 - p2) + p3 - p0)));
+}
+
+/* component c of the mesh at grid position gu, gv, smoothly interpolated */
+static double mesh_eval (calibration_data *calibration, int c, double gu, double gv) {
+
+	int n = calibration->mesh_size;
+	int iu, iv, k, r, u[4];
+	double row[4];
+
+	gu = gu < 0 ? 0 : gu > n - 1 ? n - 1 : gu;
+	gv = gv < 0 ? 0 : gv > n - 1 ? n - 1 : gv;
+	iu = (int) gu < n - 2 ? (int) gu : n - 2;
+	iv = (int) gv < n - 2 ? (int) gv : n - 2;
+
+	for (k = 0; k < 4; k++)
+		u[k] = iu + k - 1 < 0 ? 0 : iu + k - 1 > n - 1 ? n - 1 : iu + k - 1;
+
+	for (k = 0; k < 4; k++) {
+		r = iv + k - 1 < 0 ? 0 : iv + k - 1 > n - 1 ? n - 1 : iv + k - 1;
+		row[k] = mesh_cubic (calibration->mesh[r][u[0]][c], calibration->mesh[r][u[1]][c],
+				     calibration->mesh[r][u[2]][c], calibration->mesh[r][u[3]][c], gu - iu);
+	}
+	return mesh_cubic (row[0], row[1], row[2], row[3], gv - iv);
+}
+
+static short mesh_round (double d) {
+	d = d < -MESH_CORRECTION_MAX ? -MESH_CORRECTION_MAX : d > MESH_CORRECTION_MAX ? MESH_CORRECTION_MAX : d;
+	return d < 0 ? d - 0.5 : d + 0.5;
+}
+
+/*
+ * The mesh is in panel values, so it stays right when the direction is
+ * changed at run time. Its position follows the calibration values with
+ * the configured direction.
+ */
+static void transform_mesh (transform_data *tr, calibration_data *calibration, int direction, int bits) {
+
+	int n = calibration->mesh_size;
+	int u0, u1, v0, v1, p, q;
+	double gu, gv;
+
+	tr->mesh = n >= MESH_MIN && n <= MESH_MAX;
+	tr->mesh_shift = bits - MESH_LUT_BITS;
+	tr->mesh_max = AXIS_MAX(bits);
+	if (!tr->mesh)
+		return;
+
+	transform_raw_box (calibration, direction, bits, &u0, &u1, &v0, &v1);
+	if (u1 <= u0 || v1 <= v0) {
+		tr->mesh = 0;
+		return;
+	}
+
+	for (q = 0; q <= MESH_LUT; q++) {
+		for (p = 0; p <= MESH_LUT; p++) {
+			gu = (double) ((p << tr->mesh_shift) - u0) * (n - 1) / (u1 - u0);
+			gv = (double) ((q << tr->mesh_shift) - v0) * (n - 1) / (v1 - v0);
+			mesh_du[q][p] = mesh_round (mesh_eval (calibration, 0, gu, gv));
+			mesh_dv[q][p] = mesh_round (mesh_eval (calibration, 1, gu, gv));
+		}
+	}
+}
+
+static int transform_map (int v, int scale, long long offset) {
+	return (offset + (long long) v * scale + FIXED_ONE / 2) >> FIXED_SHIFT;
+}
+
+void transform_init (transform_data *tr, conf_data *conf, calibration_data *calibration, int bits) {
+
+	if (conf->screen_width > 0 && conf->screen_height > 0) {
+		transform_map_axis (calibration->xmin, calibration->xmax, conf->map_x, conf->map_width,
+				    conf->screen_width, &tr->scale_x, &tr->offset_x);
+		transform_map_axis (calibration->ymin, calibration->ymax, conf->map_y, conf->map_height,
+				    conf->screen_height, &tr->scale_y, &tr->offset_y);
+	} else {
+		tr->scale_x = tr->scale_y = FIXED_ONE;
+		tr->offset_x = tr->offset_y = 0;
+	}
+
+	// clamped to the calibration values, as mapped to the screen
+	tr->xmin = transform_map (calibration->xmin, tr->scale_x, tr->offset_x);
+	tr->xmax = transform_map (calibration->xmax, tr->scale_x, tr->offset_x);
+	tr->ymin = transform_map (calibration->ymin, tr->scale_y, tr->offset_y);
+	tr->ymax = transform_map (calibration->ymax, tr->scale_y, tr->offset_y);
+
+	// edge margins are expressed inside the calibrated area
+	tr->edge_xmin = transform_map (calibration->xmin + conf->edge_left, tr->scale_x, tr->offset_x);
+	tr->edge_xmax = transform_map (calibration->xmax - conf->edge_right, tr->scale_x, tr->offset_x);
+	tr->edge_ymin = transform_map (calibration->ymin + conf->edge_top, tr->scale_y, tr->offset_y);
+	tr->edge_ymax = transform_map (calibration->ymax - conf->edge_bottom, tr->scale_y, tr->offset_y);
+
+	transform_range (conf, calibration, &tr->range_xmin, &tr->range_xmax, &tr->range_ymin, &tr->range_ymax);
+	transform_mesh (tr, calibration, conf->direction, bits);
+
+	transform_direction (tr, conf->direction, bits);
+}
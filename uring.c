@@ -0,0 +1,428 @@
+/*
+ *   opengalax touchscreen daemon
+ *   Copyright 2012 Pau Oliva Fora <pof@eslack.org>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+#include <linux/io_uring.h>
+#include "opengalax.h"
+
+/*
+ * io_uring I/O backend, talking to the kernel directly so there is no
+ * library dependency. A read is always queued on the serial port (two
+ * buffers, one being decoded while the kernel fills the other), uinput
+ * writes and the main loop deadline are queued as SQEs, and everything is
+ * submitted with the same io_uring_enter() that waits for completions.
+ */
+
+#define RING_ENTRIES 64
+#define WRITE_SLOTS 32
+#define WRITE_EVENTS 16
+
+#define TAG_READ	1
+#define TAG_SIGNAL	2
+#define TAG_WRITE	3
+#define TAG_TIMEOUT	4
+#define TAG_REMOVE	5
+#define TAG_WAKE	6
+#define TAG_CANCEL	7
+
+#define TAG(tag, gen) (((unsigned long long)(gen) << 8) | (tag))
+
+static struct {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_local_tail;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit;
+} ring = { .fd = -1 };
+
+static int fd_input = -1;
+static int fd_sig = -1;
+static int fd_wakeup = -1;
+
+static unsigned char rbuf[2][BATCH_MAX * 5];
+static int rbuf_next;
+
+static struct signalfd_siginfo siginfo;
+static uint64_t wakeups;
+
+static struct input_event wbuf[WRITE_SLOTS][WRITE_EVENTS];
+static int wbuf_next;
+static int writes_inflight;
+
+/* a read completed while uring_write() was waiting for a free slot */
+static int pending_len = -1;
+static int pending_gen;
+
+/* and a signal, the signalfd is read again once it was handed out */
+static int pending_sig;
+
+/* the queued read is being cancelled, what it got is stale */
+static int read_discard;
+
+static struct __kernel_timespec deadline;
+static int deadline_armed;
+static unsigned deadline_gen;
+
+static struct io_uring_sqe *get_sqe (void) {
+
+	unsigned head = __atomic_load_n (ring.sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = ring.sq_local_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= ring.entries)
+		return NULL;
+
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+	memset (sqe, 0, sizeof (*sqe));
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	ring.sq_local_tail = tail + 1;
+	ring.to_submit++;
+	return sqe;
+}
+
+static int ring_enter (unsigned min_complete) {
+
+	unsigned submit = ring.to_submit;
+	int ret;
+
+	__atomic_store_n (ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall (__NR_io_uring_enter, ring.fd, submit, min_complete,
+			       min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		die ("error: io_uring_enter");
+
+	ring.to_submit -= ret;
+	return ret;
+}
+
+/* SQ full: push what is queued to the kernel and try again */
+static struct io_uring_sqe *sqe_or_submit (void) {
+
+	struct io_uring_sqe *sqe = get_sqe ();
+
+	if (sqe == NULL) {
+		ring_enter (0);
+		sqe = get_sqe ();
+		if (sqe == NULL)
+			die ("error: io_uring queue full");
+	}
+	return sqe;
+}
+
+static void queue_read (void) {
+
+	struct io_uring_sqe *sqe = sqe_or_submit ();
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd_input;
+	sqe->addr = (unsigned long) rbuf[rbuf_next];
+	sqe->len = sizeof (rbuf[0]);
+	sqe->off = -1;
+	sqe->user_data = TAG (TAG_READ, rbuf_next);
+}
+
+static void queue_signal_read (void) {
+
+	struct io_uring_sqe *sqe = sqe_or_submit ();
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd_sig;
+	sqe->addr = (unsigned long) &siginfo;
+	sqe->len = sizeof (siginfo);
+	sqe->off = -1;
+	sqe->user_data = TAG (TAG_SIGNAL, 0);
+}
+
+static void queue_wake_read (void) {
+
+	struct io_uring_sqe *sqe = sqe_or_submit ();
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd_wakeup;
+	sqe->addr = (unsigned long) &wakeups;
+	sqe->len = sizeof (wakeups);
+	sqe->off = -1;
+	sqe->user_data = TAG (TAG_WAKE, 0);
+}
+
+/*
+ * uring_init() sets up the ring and queues the first reads. fd_wake is an
+ * eventfd that only has to interrupt uring_wait(), or -1. Returns -1 if
+ * io_uring is not available, so the caller can stay on select() and read().
+ */
+int uring_init (int fd, int fd_signal, int fd_wake) {
+
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	void *sq, *cq;
+
+	memset (&p, 0, sizeof (p));
+	ring.fd = syscall (__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (ring.fd < 0)
+		return -1;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+
+	sq = mmap (NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap (NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+
+	ring.sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto fail;
+
+	ring.entries = p.sq_entries;
+	ring.sq_head = (unsigned *)((char *)sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)((char *)sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)((char *)sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)((char *)sq + p.sq_off.array);
+	ring.sq_local_tail = *ring.sq_tail;
+	ring.cq_head = (unsigned *)((char *)cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)((char *)cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)((char *)cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+
+	fd_input = fd;
+	fd_sig = fd_signal;
+	fd_wakeup = fd_wake;
+
+	queue_read ();
+	if (fd_sig >= 0)
+		queue_signal_read ();
+	if (fd_wakeup >= 0)
+		queue_wake_read ();
+
+	return 0;
+
+fail:
+	close (ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+
+/*
+ * uring_flush() drops the serial data read so far, on resume: the queued
+ * read is cancelled and whatever it got thrown away before the port is
+ * flushed, then a new read is queued.
+ */
+void uring_flush (void) {
+
+	struct io_uring_sqe *sqe;
+
+	if (pending_len >= 0) {
+		// completed while uring_write() waited, no read is queued
+		pending_len = -1;
+	} else {
+		sqe = sqe_or_submit ();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = TAG (TAG_READ, rbuf_next);
+		sqe->user_data = TAG (TAG_CANCEL, 0);
+		read_discard = 1;
+		while (read_discard)
+			uring_wait (NULL, 0, NULL);
+	}
+
+	flush_serial_port ();
+	queue_read ();
+}
+
+/*
+ * uring_write() queues 'count' events for fd. They are submitted with the
+ * next uring_wait(), without a syscall of their own.
+ */
+void uring_write (int fd, const struct input_event *ev, int count) {
+
+	struct io_uring_sqe *sqe;
+	struct input_event *slot;
+
+	if (count > WRITE_EVENTS)
+		die ("error: too many events");
+
+	// every slot in flight: wait for the oldest writes to complete
+	while (writes_inflight == WRITE_SLOTS)
+		uring_wait (NULL, 0, NULL);
+
+	slot = wbuf[wbuf_next];
+	wbuf_next = (wbuf_next + 1) % WRITE_SLOTS;
+	memcpy (slot, ev, count * sizeof (*ev));
+
+	sqe = sqe_or_submit ();
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) slot;
+	sqe->len = count * sizeof (*ev);
+	sqe->off = -1;
+	sqe->user_data = TAG (TAG_WRITE, 0);
+	writes_inflight++;
+}
+
+/* arm the main loop deadline as a timeout SQE, replacing the previous one */
+static void queue_timeout (int timeout) {
+
+	struct io_uring_sqe *sqe;
+	struct timespec now;
+	long long ns;
+
+	if (deadline_armed) {
+		sqe = sqe_or_submit ();
+		sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+		sqe->addr = TAG (TAG_TIMEOUT, deadline_gen);
+		sqe->user_data = TAG (TAG_REMOVE, 0);
+		deadline_armed = 0;
+	}
+
+	if (timeout < 0)
+		return;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	ns = now.tv_nsec + timeout * 1000000LL;
+	deadline.tv_sec = now.tv_sec + ns / 1000000000LL;
+	deadline.tv_nsec = ns % 1000000000LL;
+
+	sqe = sqe_or_submit ();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long) &deadline;
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ABS;
+	sqe->user_data = TAG (TAG_TIMEOUT, ++deadline_gen);
+	deadline_armed = 1;
+}
+
+/*
+ * uring_wait() submits everything queued and waits for serial data, a
+ * signal or 'timeout' ms (-1 waits forever). Returns the number of bytes
+ * read into *data, 0 on timeout and -1 when woken up by something else.
+ * *sig is set to the signal received, if any.
+ */
+int uring_wait (unsigned char **data, int timeout, int *sig) {
+
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	int ret = -1;
+	int tag, gen;
+
+	if (data != NULL) {
+		*sig = 0;
+		if (pending_sig) {
+			*sig = pending_sig;
+			pending_sig = 0;
+			queue_signal_read ();
+		}
+		if (pending_len >= 0) {
+			*data = rbuf[pending_gen];
+			ret = pending_len;
+			pending_len = -1;
+			rbuf_next = !pending_gen;
+			queue_read ();
+			return ret;
+		}
+		if (*sig)
+			return ret;
+		queue_timeout (timeout);
+	}
+
+	ring_enter (1);
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		tag = cqe->user_data & 0xff;
+		gen = cqe->user_data >> 8;
+
+		switch (tag) {
+			case TAG_READ:
+				if (read_discard) {
+					read_discard = 0;
+					break;
+				}
+				if (cqe->res == -EAGAIN || cqe->res == -EINTR) {
+					queue_read ();
+					break;
+				}
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					die ("error reading from serial port");
+				}
+				if (data == NULL) {
+					// called from uring_write(), keep it for the next wait
+					pending_gen = gen;
+					pending_len = cqe->res;
+					break;
+				}
+				*data = rbuf[gen];
+				ret = cqe->res;
+				// keep a read queued while the caller decodes this buffer
+				rbuf_next = !gen;
+				queue_read ();
+				break;
+			case TAG_SIGNAL:
+				if (cqe->res == sizeof (siginfo) && data == NULL) {
+					// called from uring_write(), keep it for the next wait
+					pending_sig = siginfo.ssi_signo;
+					break;
+				}
+				if (cqe->res == sizeof (siginfo))
+					*sig = siginfo.ssi_signo;
+				queue_signal_read ();
+				break;
+			case TAG_WAKE:
+				queue_wake_read ();
+				break;
+			case TAG_WRITE:
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					die ("error: write");
+				}
+				writes_inflight--;
+				break;
+			case TAG_TIMEOUT:
+				if (gen == (int)deadline_gen && cqe->res == -ETIME) {
+					deadline_armed = 0;
+					if (ret < 0)
+						ret = 0;
+				}
+				break;
+		}
+	}
+
+	__atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+
+	return ret;
+}